@@ -86,6 +86,11 @@ public:
 		bufferWritePointer = element % bufferSize;
 	}
 	
+	// Empty the whole buffer
+	inline void clear(){
+		memset(buffer, 0, bufferSize * sizeof(float));
+	}
+	
 	// Returns the size of the buffer
 	inline int size(){
 		return bufferSize;
@@ -119,6 +124,18 @@ public:
 		}
 	}
 	
+	// Add a sample to whatever exists in the desired element, without moving the write pointer
+	inline void addToElement(int element, float entry){
+
+		// Ensure element is within bounds
+		while(element < 0){
+			element += bufferSize;
+		}
+		element = element % bufferSize;
+
+		buffer[element] += entry;
+	}
+
 private:
 	const int bufferSize;
 	int bufferReadPointer = 0;
@@ -56,5 +56,22 @@ float compareNotes(int scale, float frequency){
 	return 0;
 }
 
+// Finds the closest note in the scale, transposed up by key semitones, to the provided frequency
+float compareNotes(int scale, float frequency, int key){
+	if(key == 0){
+		return compareNotes(scale, frequency);
+	}
+	float transposition = powf(2, (float)key / 12.0);
+	return compareNotes(scale, frequency / transposition) * transposition;
+}
+
+// Moves frequency strength of the way to note, in pitch. 1 gives the note, 0 leaves the frequency as it is
+float correctTowards(float frequency, float note, float strength){
+	if(strength >= 1 || frequency <= 0 || note <= 0){
+		return note;
+	}
+	return frequency * powf(note / frequency, strength);
+}
+
 
 #endif //COMPARENOTES_H
\ No newline at end of file
@@ -0,0 +1,80 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef CONTROLPARAMETERS_H
+#define CONTROLPARAMETERS_H
+
+#include <atomic>
+#include <math.h>
+
+#define CONTROL_MAX_CHANNELS 8
+
+// Live controls, set by render() and read by the processing thread once at the start of each hop
+struct controlParameters{
+	int scale; // Scale to correct to
+	int key; // Semitones above C
+	float strength; // Share of the correction applied, from 0 (none) to 1 (snap to the note)
+	bool disabled; // Pass the audio through unprocessed
+	bool exportSpectrum; // Write the spectrum and HPS of the next hop to text files
+	int engines[CONTROL_MAX_CHANNELS]; // Correction engine of each channel - see correctionChannel.h
+};
+
+// Passes controlParameters from one real-time thread to another without locks, using a triple buffer
+// The writer fills a slot of its own and swaps it with the middle slot. The reader swaps its own slot with the middle
+// slot when a new one has been published. Neither thread ever touches the slot the other is using, so a set of
+// parameters is never seen half written, and both sides are wait-free
+class controlBlock{
+public:
+	controlBlock(const controlParameters& initial){ // Constructor
+		for(int i = 0; i < 3; i++){
+			slots[i] = initial;
+		}
+	}
+
+	// The writer's slot, to fill before publishing. Writer thread only
+	inline controlParameters& edit(){
+		return slots[writeSlot];
+	}
+
+	// Make the writer's slot the latest set of parameters. Writer thread only
+	inline void publish(){
+		int previous = middle.exchange(writeSlot | kFresh, std::memory_order_acq_rel);
+		int next = previous & kSlotMask;
+
+		// Carry the parameters on into the slot to be edited next, so the writer can change one at a time
+		slots[next] = slots[writeSlot];
+		writeSlot = next;
+	}
+
+	// Copy the latest parameters into parameters. Returns true if they have changed since the last read. Reader thread only
+	inline bool read(controlParameters& parameters){
+		bool fresh = (middle.load(std::memory_order_relaxed) & kFresh) != 0;
+		if(fresh){
+			int previous = middle.exchange(readSlot, std::memory_order_acq_rel);
+			readSlot = previous & kSlotMask;
+		}
+		parameters = slots[readSlot];
+		return fresh;
+	}
+
+private:
+	static const int kSlotMask = 3;
+	static const int kFresh = 4; // Set in middle when it holds parameters the reader hasn't seen
+
+	controlParameters slots[3];
+	int writeSlot = 0;
+	int readSlot = 1;
+	std::atomic<int> middle{2};
+};
+
+// Moves value towards target by a share of the difference each hop, so that changes don't jump
+inline float smoothParameter(float value, float target, float share){
+	float next = value + (target - value) * share;
+	return (fabsf(target - next) < 1e-3) ? target : next;
+}
+
+#endif //CONTROLPARAMETERS_H
@@ -0,0 +1,568 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef CORRECTIONCHANNEL_H
+#define CORRECTIONCHANNEL_H
+
+#include "circularBuffer.h"
+#include "fftContainer.h"
+#include "fixedPoint.h"
+#include "spectrum.h"
+#include "hps.h"
+#include "compareNotes.h"
+#include "phaseVocoder.h"
+#include "psola.h"
+#include "decimator.h"
+#include "formantEnvelope.h"
+#include "telemetry.h"
+
+enum{ // Available pitch correction engines
+	ENGINE_PHASE_VOCODER = 0, // Spectral correction, suited to complex sources
+	ENGINE_PSOLA = 1 // Time-domain correction with no inverse FFT, for simple monophonic sources
+};
+
+// How a correctionChannel is built. These can't change once it is running
+struct correctionConfig{
+	int windowSize = 4096; // Correction window
+	int hopSize = 1024;
+	int sampleRate = 44100;
+	int detectionWindowSize = 0; // Pitch detection window, ending at the same sample as the correction window. 0 uses windowSize
+	int bufferSize = 16384; // Size of the input and output circular buffers
+	bool decimatedAnalysis = false; // Detect pitch on a decimated copy of the input
+	int decimationFactor = 4;
+	bool fixedPoint = false; // Window, FFT, IFFT and HPS in Q31
+	bool formantPreservation = false; // Keep the formants in place when the phase vocoder shifts the pitch
+	int voices = 1; // Voices corrected separately by the phase vocoder
+	int engine = ENGINE_PHASE_VOCODER;
+};
+
+// The per-hop controls of a correctionChannel
+struct correctionControls{
+	int scale = 0;
+	int key = 0; // Semitones above C
+	float strength = 1; // Share of the correction applied
+	bool disabled = false; // Pass the audio through unprocessed
+	bool exportSpectrum = false; // Write the spectrum and HPS of this hop to text files
+};
+
+// One channel of pitch correction: the input and output buffers, pitch detection and both correction engines
+// render() runs one per audio channel on its processing thread, and the offline tools run them through pitchCorrector.h,
+// so every program shares the same processing
+// A hop is the window ending at inputPointer. Its output is overlap-added a hop later, at inputPointer + hopSize,
+// so that render() has a hop of margin to process it in. The latency is a window and a hop
+class correctionChannel{
+public:
+	// Hops whose window stays below this level (about -60dBFS) are silent. Both engines restart from the input on them,
+	// which can't be heard, so nothing before a silent hop changes the output after it. batchCorrect splits files there
+	static constexpr float kSilenceThreshold = 0.001;
+
+	correctionChannel(const correctionConfig& c):config(c){ // Constructor, to be called in setup()
+		windowSize = config.windowSize;
+		hopSize = config.hopSize;
+		detectionWindowSize = (config.detectionWindowSize > 0) ? config.detectionWindowSize : windowSize;
+		separateAnalysis = (config.decimatedAnalysis || detectionWindowSize != windowSize);
+		analysisWindowSize = config.decimatedAnalysis ? detectionWindowSize / config.decimationFactor : detectionWindowSize;
+		engine = config.engine;
+		grainsRunning = (engine == ENGINE_PSOLA);
+
+		inputBuffer = new circularBuffer(config.bufferSize);
+		outputBuffer = new circularBuffer(config.bufferSize);
+		fft = new FFTContainer(windowSize, config.sampleRate);
+		hanningWindow = fftPlanCache::acquireHanningWindow(windowSize);
+
+		if(config.decimatedAnalysis){
+			decimation = new decimator(config.decimationFactor, config.bufferSize / config.decimationFactor);
+			analysisFFT = new FFTContainer(analysisWindowSize, config.sampleRate / config.decimationFactor);
+			hps = new HPS(analysisWindowSize, config.sampleRate / config.decimationFactor);
+		}
+		else if(separateAnalysis){
+			analysisFFT = new FFTContainer(analysisWindowSize, config.sampleRate);
+			hps = new HPS(analysisWindowSize, config.sampleRate);
+		}
+		else{
+			hps = new HPS(windowSize, config.sampleRate);
+		}
+		if(separateAnalysis){
+			analysisWindow = fftPlanCache::acquireHanningWindow(analysisWindowSize);
+		}
+
+		if(config.fixedPoint){
+			fixedFFT = new FFTContainerQ31(windowSize, config.sampleRate);
+			hanningWindowQ31 = (ne10_int32_t*) malloc (windowSize * sizeof(ne10_int32_t));
+			for(int i = 0; i < windowSize; i++){
+				hanningWindowQ31[i] = floatToQ31(hanningWindow[i]);
+			}
+		}
+
+		// Both engines are kept, as the engine can be changed while running
+		// PSOLA can cut grains from the rest of the detection window, whose pitch it is given
+		vocoder = new phaseVocoder(windowSize, hopSize, config.sampleRate);
+		grains = new psola(windowSize, hopSize, config.sampleRate, detectionWindowSize - windowSize);
+
+		if(config.formantPreservation){
+			envelope = new formantEnvelope();
+		}
+
+		voices = (config.voices < 1) ? 1 : config.voices;
+		voiceFrequencies = (float*) calloc (voices, sizeof(float));
+		voiceNotes = (float*) calloc (voices, sizeof(float));
+
+		// Storage for the unprocessed spectrum when exporting, as the phase vocoder overwrites it before the file is written
+		oldFrequencyDomain = (ne10_fft_cpx_float32_t*) malloc (windowSize * sizeof(ne10_fft_cpx_float32_t));
+	}
+
+	~correctionChannel(){ // Destructor
+		delete inputBuffer;
+		delete outputBuffer;
+		delete fft;
+		delete hps;
+		delete vocoder;
+		delete grains;
+		if(decimation){
+			delete decimation;
+		}
+		if(analysisFFT){
+			delete analysisFFT;
+		}
+		if(fixedFFT){
+			delete fixedFFT;
+		}
+		if(envelope){
+			delete envelope;
+		}
+		fftPlanCache::release(hanningWindow);
+		fftPlanCache::release(analysisWindow);
+		free(hanningWindowQ31);
+		free(voiceFrequencies);
+		free(voiceNotes);
+		free(oldFrequencyDomain);
+	}
+
+	// Add an input sample, and take the next output sample. Call once per frame
+	inline void insert(float in){
+		inputBuffer->insert(in);
+		if(decimation){
+			decimation->process(in);
+		}
+	}
+
+	inline float returnAndEmptyNextElement(){
+		return outputBuffer->returnAndEmptyNextElement();
+	}
+
+	// Buffer positions to pass to processHop() for the window ending at the latest input
+	inline int returnInputPointer(){
+		return inputBuffer->returnWritePointer();
+	}
+
+	inline int returnDecimatedPointer(){
+		return decimation ? decimation->returnOutputBuffer()->returnWritePointer() : 0;
+	}
+
+	// Correct the window ending at inputPointer, detecting pitch again if analyse is set, and overlap-add it to the output
+	// Output before firstSample (relative to the start of the hop's output) has already been played, so isn't written
+	// The stage times and pitch of the hop are filled in to record
+	void processHop(int inputPointer, int decimatedPointer, int firstSample, bool analyse, const correctionControls& controls,
+		telemetryRecord& record);
+
+	// Write the input of a hop to the output unprocessed
+	// PSOLA is run unshifted, so that its grains line up with the hops either side at the same gain
+	// The phase vocoder's Hanning windowed input, which overlap-adds like a processed window, is only written if spectral is set
+	void bypassHop(int inputPointer, int firstSample, bool spectral);
+
+	// Change the correction engine. The new engine starts from the input, as its state from before it was last used is stale
+	void setEngine(int e){
+		if(e == engine){
+			return;
+		}
+		if(e == ENGINE_PSOLA){
+			grains->reset();
+		}
+		else{
+			vocoder->restartPhase();
+		}
+		engine = e;
+		grainsRunning = (e == ENGINE_PSOLA);
+	}
+
+	int returnEngine(){
+		return engine;
+	}
+
+	// Peak detection settings for the pitch detector - see HPS::setPeakDetection()
+	void setPeakDetection(int lag, float threshold){
+		hps->setPeakDetection(lag, threshold);
+	}
+
+	// Clear all state, to start on unrelated audio
+	void reset(){
+		inputBuffer->clear();
+		outputBuffer->clear();
+		inputBuffer->setWritePointer(0);
+		outputBuffer->setReadPointer(0);
+		if(decimation){
+			decimation->reset();
+		}
+		vocoder->reset();
+		grains->reset();
+		grainsRunning = (engine == ENGINE_PSOLA);
+		fundamentalFrequency = 0;
+		desiredNote = 0;
+		peakBin = 0;
+		voiceCount = 0;
+		hopsBelowRange = 0;
+	}
+
+	// Samples from a sample going in to its corrected version coming out
+	int returnLatency(){
+		return windowSize + hopSize;
+	}
+
+	// The lowest fundamental the current engine can correct. Lower pitches are passed through unshifted
+	// A single voice below the phase vocoder's range is corrected by PSOLA, which can reach back into the detection window
+	float returnMinimumFrequency(){
+		if(engine == ENGINE_PSOLA){
+			return grains->returnMinimumFrequency();
+		}
+		if(voices == 1){
+			return fminf(vocoder->returnMinimumFrequency(), grains->returnMinimumFrequency());
+		}
+		return vocoder->returnMinimumFrequency();
+	}
+
+	// Hops passed through unshifted because their fundamental was below returnMinimumFrequency()
+	int returnHopsBelowRange(){
+		return hopsBelowRange;
+	}
+
+	// The last valid pitch, and the note the last hop was corrected to
+	float returnFundamentalFrequency(){
+		return fundamentalFrequency;
+	}
+
+	float returnDesiredNote(){
+		return desiredNote;
+	}
+
+	// Size of the FFT used for pitch detection
+	int returnAnalysisWindowSize(){
+		return separateAnalysis ? analysisWindowSize : windowSize;
+	}
+
+private:
+	const correctionConfig config;
+	int windowSize;
+	int hopSize;
+	int detectionWindowSize;
+	int analysisWindowSize; // Size of the analysis FFT, which is shorter than detectionWindowSize when decimated
+	bool separateAnalysis; // Pitch is detected on its own FFT rather than the full-band one
+	int engine;
+	int voices;
+
+	circularBuffer* inputBuffer;
+	circularBuffer* outputBuffer;
+	FFTContainer* fft;
+	const float* hanningWindow; // Shared through fftPlanCache
+	HPS* hps;
+	decimator* decimation = nullptr;
+	FFTContainer* analysisFFT = nullptr; // FFT for pitch detection on the decimated signal or the longer window
+	const float* analysisWindow = nullptr;
+	FFTContainerQ31* fixedFFT = nullptr;
+	ne10_int32_t* hanningWindowQ31 = nullptr;
+	phaseVocoder* vocoder;
+	psola* grains;
+	bool grainsRunning; // PSOLA processed the last hop, so its pitch marks carry on
+	formantEnvelope* envelope = nullptr;
+	ne10_fft_cpx_float32_t* oldFrequencyDomain;
+
+	float fundamentalFrequency = 0; // Last valid pitch
+	float desiredNote = 0;
+	int peakBin = 0; // Peak bin of the last pitch detection, for the hops in between
+	float* voiceFrequencies; // Fundamentals of each voice found by the last pitch detection
+	float* voiceNotes; // The notes each voice is corrected to
+	int voiceCount = 0;
+	int hopsBelowRange = 0;
+
+	// Whether every sample of the window ending at inputPointer is below kSilenceThreshold
+	bool isSilent(int inputPointer);
+};
+
+// Correct the window ending at inputPointer, and overlap-add it to the output
+void correctionChannel::processHop(int inputPointer, int decimatedPointer, int firstSample, bool analyse, const correctionControls& controls,
+	telemetryRecord& record){
+
+	// The full-band FFT is needed for spectral correction, and for pitch detection unless it has its own FFT
+	bool spectral = (engine == ENGINE_PHASE_VOCODER);
+	bool fullBand = (spectral || separateAnalysis == false);
+	bool grainHop = (spectral == false); // PSOLA corrects this hop
+	int outputStart = inputPointer + hopSize;
+
+	uint64_t stageStart = telemetry::now();
+
+	// Forget the pitch and the engines' phases and pitch marks over silence
+	if(isSilent(inputPointer)){
+		vocoder->restartPhase();
+		grains->reset();
+		fundamentalFrequency = 0;
+		peakBin = 0;
+		voiceCount = 0;
+	}
+
+	// Load the input window, unless the full-band FFT isn't needed
+	if(fullBand){
+		inputBuffer->setReadPointer(inputPointer - windowSize);
+		if(config.fixedPoint){
+			for(int i = 0; i < windowSize; i++){
+				fixedFFT->timeDomainIn[i].r = multiplyQ31(floatToQ31(inputBuffer->returnNextElement()), hanningWindowQ31[i]);
+				fixedFFT->timeDomainIn[i].i = 0;
+			}
+		}
+		else{
+			for(int i = 0; i < windowSize; i++){
+				fft->timeDomainIn[i].r = (ne10_float32_t)inputBuffer->returnNextElement() * hanningWindow[i];
+				fft->timeDomainIn[i].i = 0;
+			}
+		}
+	}
+
+	// Load the decimated signal, or the longer detection window, into the analysis FFT
+	if(separateAnalysis && analyse){
+		circularBuffer* analysisBuffer = inputBuffer;
+		int analysisPointer = inputPointer;
+		if(decimation){
+			analysisBuffer = decimation->returnOutputBuffer();
+			analysisPointer = decimatedPointer;
+		}
+		analysisBuffer->setReadPointer(analysisPointer - analysisWindowSize);
+		for(int i = 0; i < analysisWindowSize; i++){
+			analysisFFT->timeDomainIn[i].r = (ne10_float32_t)analysisBuffer->returnNextElement() * analysisWindow[i];
+			analysisFFT->timeDomainIn[i].i = 0;
+		}
+	}
+
+	// Calculate FFT
+	if(fullBand && config.fixedPoint){
+		fixedFFT->forward();
+
+		// The phase vocoder and spectrum export work on a float copy of the spectrum
+		if(controls.disabled == false && (spectral || controls.exportSpectrum)){
+			spectrumQ31ToFloat(fixedFFT->frequencyDomain, fixedFFT->frequencyExponent, fft->frequencyDomain, windowSize);
+		}
+	}
+	else if(fullBand){
+		ne10_fft_c2c_1d_float32_neon(fft->frequencyDomain, fft->timeDomainIn, fft->cfg, 0);
+	}
+
+	uint64_t stageEnd = telemetry::now();
+	record.stageTimes[TELEMETRY_STAGE_FFT] = stageEnd - stageStart;
+	stageStart = stageEnd;
+
+	// ---- Frequency domain processing ---- //
+
+	if(controls.disabled == false){ // Disable processing if button 2 is pressed
+
+		// Output a .txt frequency spectrum when the button is pressed (low)
+		// Will overwrite files with the same name
+		// Can cause problems to the audio when used
+		if(controls.exportSpectrum && fullBand){
+
+			// Store frequencyDomain so that it isn't overwritten before output is complete
+			for(int i = 0; i < windowSize; i++){
+				oldFrequencyDomain[i].r = fft->frequencyDomain[i].r;
+				oldFrequencyDomain[i].i = fft->frequencyDomain[i].i;
+			}
+			generateFrequencySpectrum(oldFrequencyDomain, fft->sampleRate, fft->size, "frequency_spectrumOld.txt");
+		}
+
+		// Use harmonic product spectrum to find the fundamental frequency of the incoming sound
+		// Between analysis hops the last detection is reused. The phase vocoder only uses the bin to tell if it was voiced
+		float frequency = (peakBin != 0) ? fundamentalFrequency : 0;
+		if(analyse){
+			if(separateAnalysis){
+				// Pitch is detected on the decimated signal or the longer window, with its own FFT
+				ne10_fft_c2c_1d_float32_neon(analysisFFT->frequencyDomain, analysisFFT->timeDomainIn, analysisFFT->cfg, 0);
+				hps->importSpectrum(analysisFFT->frequencyDomain);
+				hps->calculate();
+			}
+			else if(config.fixedPoint){
+				hps->importFixedPointSpectrum(fixedFFT->frequencyDomain, fixedFFT->frequencyExponent);
+				hps->calculateFixedPoint();
+			}
+			else{
+				hps->importSpectrum(fft->frequencyDomain);
+				hps->calculate();
+			}
+			peakBin = hps->returnPeakLocation();
+			frequency = hps->estimateFundamentalFrequency(peakBin);
+		}
+
+		// Only update the fundamental frequency if the output is valid
+		if(frequency != 0){
+			fundamentalFrequency = frequency;
+		}
+
+		// Find the note that's closest to the fundamental frequency, and how far to move towards it
+		desiredNote = compareNotes(controls.scale, fundamentalFrequency, controls.key);
+		desiredNote = correctTowards(fundamentalFrequency, desiredNote, controls.strength);
+
+		// Leave fundamentals the window can't shift cleanly where they are
+		float lowestFrequency = returnMinimumFrequency();
+		bool belowRange = (peakBin != 0 && fundamentalFrequency < lowestFrequency);
+		if(belowRange){
+			desiredNote = fundamentalFrequency;
+			hopsBelowRange++;
+		}
+
+		// A single voice below the phase vocoder's range is corrected by PSOLA instead, for as long as it stays there
+		if(spectral && voices == 1 && peakBin != 0 && belowRange == false && fundamentalFrequency < vocoder->returnMinimumFrequency()){
+			grainHop = true;
+		}
+
+		// For monitoring
+		record.fundamentalFrequency = frequency;
+		record.desiredNote = desiredNote;
+		record.peakBin = peakBin;
+		record.confidence = hps->returnConfidence();
+		stageEnd = telemetry::now();
+		record.stageTimes[TELEMETRY_STAGE_PITCH] = stageEnd - stageStart;
+		stageStart = stageEnd;
+
+		// Output a .txt file conatining the HPS when the button is pressed (low)
+		// Will overwrite files with the same name
+		// Can cause problems to the audio when used
+		if(controls.exportSpectrum){
+			hps->exportHPS("HPSBefore.txt");
+		}
+
+		// Estimate the formants from the same amplitude spectrum. Hops between analyses keep the last envelope
+		if(envelope && spectral){
+			if(analyse){
+				hps->estimateEnvelope(envelope);
+			}
+			stageEnd = telemetry::now();
+			record.stageTimes[TELEMETRY_STAGE_ENVELOPE] = stageEnd - stageStart;
+			stageStart = stageEnd;
+		}
+
+		if(grainHop == false){
+			if(belowRange){
+				// Resynthesising unresolved harmonics loses level, so the spectrum is left as it is
+				// The phases restart from the input once the pitch is back in range
+				vocoder->restartPhase();
+			}
+			else if(voices > 1){
+				// Find the other voices, and shift each one's harmonics towards its own nearest note
+				if(analyse){
+					voiceCount = hps->findFundamentals(peakBin, voiceFrequencies, voices);
+				}
+				for(int v = 0; v < voiceCount; v++){
+					voiceNotes[v] = correctTowards(voiceFrequencies[v], compareNotes(controls.scale, voiceFrequencies[v], controls.key), controls.strength);
+					if(voiceFrequencies[v] < lowestFrequency){
+						voiceNotes[v] = voiceFrequencies[v];
+					}
+				}
+				vocoder->shiftVoices(fft->frequencyDomain, voiceCount, voiceFrequencies, voiceNotes, envelope);
+			}
+			else{
+				// Shift the peak towards the desired note
+				vocoder->shiftFrequency(fft->frequencyDomain, peakBin, fundamentalFrequency, desiredNote, envelope);
+			}
+
+			// Output a .txt frequency spectrum when the button is pressed (low)
+			// Will overwrite files with the same name
+			// Can cause problems to the audio when used
+			if(controls.exportSpectrum){
+				generateFrequencySpectrum(fft->frequencyDomain, fft->sampleRate, fft->size, "frequency_spectrum.txt");
+			}
+		}
+		else{
+			// Carrying on from the phase vocoder, PSOLA starts from the input, and the vocoder will when it takes over again
+			if(grainsRunning == false){
+				grains->reset();
+			}
+			if(spectral){
+				vocoder->restartPhase();
+			}
+
+			// Resynthesise at the desired period in the time domain. Unvoiced hops pass through unshifted
+			float targetFrequency = (peakBin == 0) ? fundamentalFrequency : desiredNote;
+			grains->process(inputBuffer, outputBuffer, inputPointer, outputStart, fundamentalFrequency, targetFrequency, firstSample);
+		}
+	}
+	else if(spectral == false){
+		// Pass the input through the PSOLA engine unshifted
+		grains->process(inputBuffer, outputBuffer, inputPointer, outputStart, fundamentalFrequency, fundamentalFrequency, firstSample);
+	}
+
+	stageEnd = telemetry::now();
+	record.stageTimes[TELEMETRY_STAGE_CORRECTION] = stageEnd - stageStart;
+	stageStart = stageEnd;
+
+	// PSOLA has already overlap-added its grains
+	grainsRunning = grainHop;
+	if(grainHop){
+		record.stageTimes[TELEMETRY_STAGE_IFFT] = telemetry::now() - stageStart;
+		return;
+	}
+
+	// Calculate inverse FFT to bring the processed audio back to the time domain
+	if(config.fixedPoint){
+		// Bring the shifted spectrum back into Q31. When disabled the original Q31 spectrum is used as it is
+		if(controls.disabled == false){
+			fixedFFT->frequencyExponent = spectrumFloatToQ31(fft->frequencyDomain, fixedFFT->frequencyDomain, windowSize);
+		}
+		fixedFFT->inverse();
+	}
+	else{
+		ne10_fft_c2c_1d_float32_neon(fft->timeDomainOut, fft->frequencyDomain, fft->cfg, 1);
+	}
+
+	record.stageTimes[TELEMETRY_STAGE_IFFT] = telemetry::now() - stageStart;
+
+	// Add timeDomainOut into the output buffer. Add to any existing values to account for hop overlap
+	// Samples which have already been played are skipped
+	outputBuffer->setWritePointer(outputStart + firstSample);
+	if(config.fixedPoint){
+		for(int n = firstSample; n < windowSize; n++){
+			outputBuffer->insertAndAdd(q31ToFloat(fixedFFT->timeDomainOut[n].r, fixedFFT->outputExponent));
+		}
+	}
+	else{
+		for(int n = firstSample; n < windowSize; n++){
+			outputBuffer->insertAndAdd(fft->timeDomainOut[n].r);
+		}
+	}
+}
+
+// Whether every sample of the window ending at inputPointer is below kSilenceThreshold
+bool correctionChannel::isSilent(int inputPointer){
+	for(int i = inputPointer - windowSize; i < inputPointer; i++){
+		if(fabsf(inputBuffer->returnElement(i)) >= kSilenceThreshold){
+			return false;
+		}
+	}
+	return true;
+}
+
+// Write the input of a hop to the output unprocessed
+void correctionChannel::bypassHop(int inputPointer, int firstSample, bool spectral){
+	int outputStart = inputPointer + hopSize;
+	if(engine == ENGINE_PSOLA){
+		grains->process(inputBuffer, outputBuffer, inputPointer, outputStart, fundamentalFrequency, fundamentalFrequency, firstSample);
+		return;
+	}
+	if(spectral == false){
+		return;
+	}
+	inputBuffer->setReadPointer(inputPointer - windowSize + firstSample);
+	outputBuffer->setWritePointer(outputStart + firstSample);
+	for(int n = firstSample; n < windowSize; n++){
+		outputBuffer->insertAndAdd(inputBuffer->returnNextElement() * hanningWindow[n]);
+	}
+}
+
+#endif //CORRECTIONCHANNEL_H
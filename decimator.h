@@ -0,0 +1,108 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <math.h>
+
+#include "circularBuffer.h"
+
+// A low-pass filter and decimator used to feed the pitch detector
+// The HPS only needs the bottom of the spectrum, so analysing a signal decimated by factor
+// with a window factor times shorter keeps the same frequency resolution for a fraction of the FFT cost
+// Output samples are written into their own circular buffer, one for every factor input samples
+// The linear-phase filter delays the output by (numTaps - 1) / 2 input samples (31, 0.7ms at 44.1kHz). Compensating
+// would need input that hasn't arrived yet, or the same delay added to the correction, so the analysis window ends
+// that much earlier than the correction window. That is under 1% of the window the pitch is detected on
+
+class decimator{
+public:
+
+	decimator(int f, int bufSize, int numTaps = 63):factor(f), taps(numTaps){ // Constructor, to be called in setup()
+		coefficients = (float*)malloc(taps * sizeof(float));
+		history = (float*)malloc(2 * taps * sizeof(float)); // History is stored twice so that the filter can always read taps contiguous samples
+		memset(history, 0, 2 * taps * sizeof(float));
+		output = new circularBuffer(bufSize);
+
+		// Windowed sinc low-pass filter, cutoff just below the new Nyquist frequency
+		float cutoff = 0.45 / (float)factor; // In cycles per input sample
+		float sum = 0;
+		for(int i = 0; i < taps; i++){
+			float n = (float)i - 0.5 * (float)(taps - 1);
+			float sinc = (n == 0) ? 2 * cutoff : sin(2 * M_PI * cutoff * n) / (M_PI * n);
+			float blackman = 0.42 - 0.5 * cos((2 * M_PI * i) / (taps - 1)) + 0.08 * cos((4 * M_PI * i) / (taps - 1));
+			coefficients[i] = sinc * blackman;
+			sum += coefficients[i];
+		}
+
+		// Normalise for unity gain at DC
+		for(int i = 0; i < taps; i++){
+			coefficients[i] /= sum;
+		}
+	}
+
+	~decimator(){ // Destructor
+		free(coefficients);
+		free(history);
+		delete output;
+	}
+
+	// Add an input sample. Every factor samples, a filtered sample is written to the output buffer
+	inline void process(float sample){
+		history[historyPointer] = sample;
+		history[historyPointer + taps] = sample;
+		historyPointer++;
+		if(historyPointer >= taps){
+			historyPointer = 0;
+		}
+
+		phase++;
+		if(phase >= factor){
+			phase = 0;
+
+			// Only the retained samples are filtered
+			// history[historyPointer] is now the oldest sample, so the taps that follow are in order
+			float* h = history + historyPointer;
+			float sum = 0;
+			for(int i = 0; i < taps; i++){
+				sum += h[i] * coefficients[i];
+			}
+			output->insert(sum);
+		}
+	}
+
+	// Clear the filter history and the output, to start on unrelated audio
+	void reset(){
+		memset(history, 0, 2 * taps * sizeof(float));
+		historyPointer = 0;
+		phase = 0;
+		output->clear();
+		output->setWritePointer(0);
+	}
+
+	// Returns the buffer holding the decimated signal
+	inline circularBuffer* returnOutputBuffer(){
+		return output;
+	}
+
+	// Returns the decimation factor
+	inline int returnFactor(){
+		return factor;
+	}
+
+private:
+	const int factor;
+	const int taps;
+	float* coefficients;
+	float* history;
+	int historyPointer = 0;
+	int phase = 0;
+	circularBuffer* output;
+};
+
+#endif //DECIMATOR_H
\ No newline at end of file
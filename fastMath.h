@@ -0,0 +1,57 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef FASTMATH_H
+#define FASTMATH_H
+
+// Fast approximations of the trigonometric functions used on every bin by the phase vocoder
+// These are branchless (conditionals compile to selects) and avoid library calls,
+// so loops over arrays using them can be vectorised with NEON by -O3 -ftree-vectorize
+
+#define FAST_PI 3.14159265f
+#define FAST_HALF_PI 1.57079633f
+#define FAST_TWO_PI 6.28318531f
+#define FAST_INVERSE_TWO_PI 0.159154943f
+
+// Wrap a phase into the range -pi to pi
+// Rounds with a float to int conversion, which NEON can vectorise, rather than floor()
+inline float wrapPhase(float phase){
+	float turns = phase * FAST_INVERSE_TWO_PI;
+	int wholeTurns = (int)(turns + ((turns >= 0) ? 0.5f : -0.5f));
+	return phase - FAST_TWO_PI * (float)wholeTurns;
+}
+
+// Arctangent of y/x over all four quadrants. Maximum error is around 1e-5 radians
+inline float fastAtan2(float y, float x){
+	float absX = fabsf(x);
+	float absY = fabsf(y);
+	float a = fminf(absX, absY) / (fmaxf(absX, absY) + 1e-30f); // Always between 0 and 1
+	float s = a * a;
+	float r = ((-0.0464964749f * s + 0.15931422f) * s - 0.327622764f) * s * a + a;
+	r = (absY > absX) ? FAST_HALF_PI - r : r;
+	r = (x < 0) ? FAST_PI - r : r;
+	return (y < 0) ? -r : r;
+}
+
+// Sine of any phase. Maximum error is around 1e-6
+inline float fastSin(float phase){
+	float x = wrapPhase(phase);
+
+	// Fold into -pi/2 to pi/2, where the polynomial is accurate
+	x = (x > FAST_HALF_PI) ? FAST_PI - x : x;
+	x = (x < -FAST_HALF_PI) ? -FAST_PI - x : x;
+
+	float s = x * x;
+	return x * (1.0f + s * (-1.66666667e-1f + s * (8.33333333e-3f + s * (-1.98412698e-4f + s * 2.75573192e-6f))));
+}
+
+// Cosine of any phase
+inline float fastCos(float phase){
+	return fastSin(phase + FAST_HALF_PI);
+}
+
+#endif //FASTMATH_H
\ No newline at end of file
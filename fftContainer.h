@@ -9,6 +9,8 @@
 #ifndef FFTCONTAINER_H
 #define FFTCONTAINER_H
 
+#include "fftPlanCache.h"
+
 // The fourier xfm arrays are encapsulated here for convenience
 struct FFTContainer{
 	FFTContainer(int s, int sr):size(s), sampleRate(sr){ // Constructor
@@ -16,7 +18,7 @@ struct FFTContainer{
 		timeDomainIn  = (ne10_fft_cpx_float32_t*) NE10_MALLOC (size * sizeof(ne10_fft_cpx_float32_t));
 		timeDomainOut = (ne10_fft_cpx_float32_t*) NE10_MALLOC (size * sizeof(ne10_fft_cpx_float32_t));
 		frequencyDomain = (ne10_fft_cpx_float32_t*) NE10_MALLOC (size * sizeof(ne10_fft_cpx_float32_t));
-		cfg = ne10_fft_alloc_c2c_float32_neon(size);
+		cfg = fftPlanCache::acquireFloatPlan(size); // Shared with every other FFT of this size
 		
 		// Set timeDomainOut to zero so that the first BUFFER_SIZE samples don't bug out
 		memset(timeDomainOut, 0, size * sizeof(ne10_fft_cpx_float32_t));
@@ -25,7 +27,7 @@ struct FFTContainer{
 		NE10_FREE(timeDomainIn);
 		NE10_FREE(timeDomainOut);
 		NE10_FREE(frequencyDomain);
-		NE10_FREE(cfg);	
+		fftPlanCache::release(cfg);
 		rt_printf("FFTContainer deleted.\n");
 	}
 	
@@ -0,0 +1,157 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef FFTPLANCACHE_H
+#define FFTPLANCACHE_H
+
+#include <math.h>
+#include <mutex>
+
+// A process-wide cache of FFT configurations and window tables
+// Every channel, and every instance in a process, of a given FFT size shares one set of twiddles, and every
+// window of a given size shares one table, so extra channels only add their own working buffers to the cache footprint
+// Tables are created on first use and freed when the last user releases them. Once handed out they are never written,
+// so any number of threads can read them. Acquiring and releasing take a lock, so belong in setup() and constructors,
+// not on real-time threads
+// A Ne10 complex configuration serves both directions, so FFT tables are keyed by backend and size only
+
+enum{ // Kinds of shared table
+	TABLE_FFT_FLOAT32 = 0, // ne10_fft_cfg_float32_t for a complex transform
+	TABLE_FFT_INT32, // ne10_fft_cfg_int32_t for a complex Q31 transform
+	TABLE_HANNING, // Symmetric Hanning window of size values, for analysis and overlap-add
+	TABLE_HANNING_PERIODIC // Periodic Hanning window of size + 1 values, so that both ends can be interpolated
+};
+
+class fftPlanCache{
+public:
+	static ne10_fft_cfg_float32_t acquireFloatPlan(int size){
+		return (ne10_fft_cfg_float32_t)acquire(TABLE_FFT_FLOAT32, size);
+	}
+
+	static ne10_fft_cfg_int32_t acquireQ31Plan(int size){
+		return (ne10_fft_cfg_int32_t)acquire(TABLE_FFT_INT32, size);
+	}
+
+	static const float* acquireHanningWindow(int size){
+		return (const float*)acquire(TABLE_HANNING, size);
+	}
+
+	static const float* acquirePeriodicHanningWindow(int size){
+		return (const float*)acquire(TABLE_HANNING_PERIODIC, size);
+	}
+
+	// Give back a table from any of the acquire functions. It is freed once nothing else is using it
+	static void release(const void* table);
+
+	// Number of distinct tables alive, for reporting
+	static int returnTableCount();
+
+private:
+	struct cachedTable{
+		int type;
+		int size;
+		void* table;
+		int references;
+	};
+
+	static const int kMaxTables = 32;
+
+	static void* acquire(int type, int size);
+	static void* create(int type, int size);
+
+	// Function statics, so that the cache needs no definitions outside the header
+	static std::mutex& returnLock(){
+		static std::mutex lock;
+		return lock;
+	}
+
+	static cachedTable* returnTables(){
+		static cachedTable tables[kMaxTables] = {};
+		return tables;
+	}
+};
+
+void* fftPlanCache::acquire(int type, int size){
+	std::lock_guard<std::mutex> guard(returnLock());
+	cachedTable* tables = returnTables();
+
+	int freeSlot = -1;
+	for(int i = 0; i < kMaxTables; i++){
+		if(tables[i].references > 0 && tables[i].type == type && tables[i].size == size){
+			tables[i].references++;
+			return tables[i].table;
+		}
+		if(tables[i].references == 0 && freeSlot < 0){
+			freeSlot = i;
+		}
+	}
+
+	// A full cache still works, it just doesn't share the new table
+	void* table = create(type, size);
+	if(freeSlot < 0){
+		rt_printf("FFT plan cache full. Table of size %d not shared.\n", size);
+		return table;
+	}
+	tables[freeSlot].type = type;
+	tables[freeSlot].size = size;
+	tables[freeSlot].table = table;
+	tables[freeSlot].references = 1;
+	return table;
+}
+
+void* fftPlanCache::create(int type, int size){
+	if(type == TABLE_FFT_FLOAT32){
+		return ne10_fft_alloc_c2c_float32_neon(size);
+	}
+	if(type == TABLE_FFT_INT32){
+		return ne10_fft_alloc_c2c_int32_neon(size);
+	}
+
+	int length = (type == TABLE_HANNING_PERIODIC) ? size + 1 : size;
+	float* window = (float*)NE10_MALLOC(length * sizeof(float));
+	float denominator = (type == TABLE_HANNING_PERIODIC) ? (float)size : (float)size - 1.0;
+	for(int i = 0; i < length; i++){
+		window[i] = 0.5-(0.5*cos((2*M_PI*(float)i)/denominator));
+	}
+	return window;
+}
+
+void fftPlanCache::release(const void* table){
+	if(table == nullptr){
+		return;
+	}
+	std::lock_guard<std::mutex> guard(returnLock());
+	cachedTable* tables = returnTables();
+
+	for(int i = 0; i < kMaxTables; i++){
+		if(tables[i].references > 0 && tables[i].table == table){
+			tables[i].references--;
+			if(tables[i].references == 0){
+				NE10_FREE(tables[i].table); // Ne10 configurations are a single block, like the windows
+				tables[i].table = nullptr;
+			}
+			return;
+		}
+	}
+
+	// Not shared, because the cache was full when it was made
+	NE10_FREE((void*)table);
+}
+
+int fftPlanCache::returnTableCount(){
+	std::lock_guard<std::mutex> guard(returnLock());
+	cachedTable* tables = returnTables();
+	int count = 0;
+	for(int i = 0; i < kMaxTables; i++){
+		if(tables[i].references > 0){
+			count++;
+		}
+	}
+	return count;
+}
+
+#endif //FFTPLANCACHE_H
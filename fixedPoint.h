@@ -0,0 +1,171 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef FIXEDPOINT_H
+#define FIXEDPOINT_H
+
+#include <stdint.h>
+
+#include "fftPlanCache.h"
+
+// Helpers for the Q31 fixed-point processing mode
+// Blocks of samples share a single exponent (block floating point): a Q31 value q in a block
+// with exponent e represents q * 2^(e-31). Blocks are renormalised between stages so that the
+// largest value uses the available headroom, which keeps small bins from rounding away to zero
+
+#define Q31_MAX 2147483647
+
+// Convert a float in the range -1 to 1 to Q31, saturating
+inline ne10_int32_t floatToQ31(float value){
+	float scaled = value * 2147483648.0f;
+	if(scaled >= 2147483647.0f){
+		return Q31_MAX;
+	}
+	if(scaled <= -2147483648.0f){
+		return -Q31_MAX - 1;
+	}
+	return (ne10_int32_t)scaled;
+}
+
+// Convert a Q31 value in a block with the given exponent to a float
+inline float q31ToFloat(ne10_int32_t value, int exponent = 0){
+	return ldexpf((float)value, exponent - 31);
+}
+
+// Multiply two Q31 values
+inline ne10_int32_t multiplyQ31(ne10_int32_t a, ne10_int32_t b){
+	return (ne10_int32_t)(((int64_t)a * (int64_t)b) >> 31);
+}
+
+// Shift a block so that its largest value has guardBits bits of headroom
+// Returns the left shift applied. Subtract it from the block's exponent
+inline int normaliseBlock(ne10_int32_t* data, int length, int guardBits){
+
+	// OR together the magnitudes to find the headroom of the largest
+	uint32_t combined = 0;
+	for(int i = 0; i < length; i++){
+		combined |= (uint32_t)((data[i] < 0) ? ~data[i] : data[i]);
+	}
+	int shift = ((combined == 0) ? 31 : __builtin_clz(combined) - 1) - guardBits;
+
+	if(shift > 0){
+		for(int i = 0; i < length; i++){
+			data[i] <<= shift;
+		}
+	}
+	else if(shift < 0){
+		for(int i = 0; i < length; i++){
+			data[i] >>= -shift;
+		}
+	}
+
+	return shift;
+}
+
+// Integer square root of a 64 bit value
+inline uint32_t squareRoot64(uint64_t value){
+	uint64_t result = 0;
+	uint64_t bit = (uint64_t)1 << 62;
+
+	while(bit > value){
+		bit >>= 2;
+	}
+
+	while(bit != 0){
+		if(value >= result + bit){
+			value -= result + bit;
+			result = (result >> 1) + bit;
+		}
+		else{
+			result >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return (uint32_t)result;
+}
+
+// Convert a Q31 spectrum with the given block exponent into a float spectrum
+inline void spectrumQ31ToFloat(ne10_fft_cpx_int32_t* input, int exponent, ne10_fft_cpx_float32_t* output, int size){
+	float scale = ldexpf(1.0f, exponent - 31);
+	for(int i = 0; i < size; i++){
+		output[i].r = (float)input[i].r * scale;
+		output[i].i = (float)input[i].i * scale;
+	}
+}
+
+// Convert a float spectrum into Q31, returning the block exponent used
+inline int spectrumFloatToQ31(ne10_fft_cpx_float32_t* input, ne10_fft_cpx_int32_t* output, int size){
+	float largest = 0;
+	for(int i = 0; i < size; i++){
+		largest = fmaxf(largest, fmaxf(fabsf(input[i].r), fabsf(input[i].i)));
+	}
+	
+	// Choose the exponent so that the largest value fits with a bit to spare
+	int exponent;
+	frexpf(largest, &exponent);
+	exponent++;
+	
+	float scale = ldexpf(1.0f, 31 - exponent);
+	for(int i = 0; i < size; i++){
+		output[i].r = (ne10_int32_t)(input[i].r * scale);
+		output[i].i = (ne10_int32_t)(input[i].i * scale);
+	}
+	
+	return exponent;
+}
+
+// The Q31 equivalent of FFTContainer, with the block exponent of each array
+struct FFTContainerQ31{
+	FFTContainerQ31(int s, int sr):size(s), sampleRate(sr){ // Constructor
+		timeDomainIn  = (ne10_fft_cpx_int32_t*) NE10_MALLOC (size * sizeof(ne10_fft_cpx_int32_t));
+		timeDomainOut = (ne10_fft_cpx_int32_t*) NE10_MALLOC (size * sizeof(ne10_fft_cpx_int32_t));
+		frequencyDomain = (ne10_fft_cpx_int32_t*) NE10_MALLOC (size * sizeof(ne10_fft_cpx_int32_t));
+		cfg = fftPlanCache::acquireQ31Plan(size); // Shared with every other FFT of this size
+		log2Size = 0;
+		while((1 << log2Size) < size){
+			log2Size++;
+		}
+
+		memset(timeDomainOut, 0, size * sizeof(ne10_fft_cpx_int32_t));
+	}
+	~FFTContainerQ31(){
+		NE10_FREE(timeDomainIn);
+		NE10_FREE(timeDomainOut);
+		NE10_FREE(frequencyDomain);
+		fftPlanCache::release(cfg);
+		rt_printf("FFTContainerQ31 deleted.\n");
+	}
+
+	// Normalise timeDomainIn, which has the given exponent, and transform it
+	inline void forward(int inputExponent = 0){
+		inputExponent -= normaliseBlock((ne10_int32_t*)timeDomainIn, 2 * size, 1);
+		ne10_fft_c2c_1d_int32_neon(frequencyDomain, timeDomainIn, cfg, 0, 1);
+		frequencyExponent = inputExponent + log2Size; // The scaled transform divides by size
+	}
+
+	// Normalise frequencyDomain and inverse transform it, tracking the exponent
+	inline void inverse(){
+		frequencyExponent -= normaliseBlock((ne10_int32_t*)frequencyDomain, 2 * size, 1);
+		ne10_fft_c2c_1d_int32_neon(timeDomainOut, frequencyDomain, cfg, 1, 1);
+		outputExponent = frequencyExponent; // The scaled inverse divides by size, like the float inverse
+	}
+
+	ne10_fft_cpx_int32_t* timeDomainIn;
+	ne10_fft_cpx_int32_t* frequencyDomain;
+	ne10_fft_cpx_int32_t* timeDomainOut;
+	ne10_fft_cfg_int32_t cfg;
+
+	int frequencyExponent = 0; // Block exponents
+	int outputExponent = 0;
+
+	int size;
+	int log2Size;
+	int sampleRate;
+};
+
+#endif //FIXEDPOINT_H
\ No newline at end of file
@@ -0,0 +1,135 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef FORMANTENVELOPE_H
+#define FORMANTENVELOPE_H
+
+#include <math.h>
+
+#include "fftPlanCache.h"
+
+// A cepstral estimate of the spectral envelope, so that pitch shifts can keep the formants where they were
+// It works on an amplitude spectrum that has already been calculated (the HPS's), so the only transform is a small one:
+// the amplitudes are pooled into kBands bands up to kMaxFrequency, the log of the bands is mirrored into a kTransformSize
+// point FFT to give the real cepstrum, and the first kCoefficients cepstral coefficients are summed back into a smooth
+// log envelope. Each band takes the largest amplitude within a band either side, so the gaps between harmonics
+// don't pull the envelope down. Above kMaxFrequency, or the top of the analysed spectrum, the envelope is held flat
+class formantEnvelope{
+public:
+	formantEnvelope(){ // Constructor, to be called in setup()
+		timeDomain = (ne10_fft_cpx_float32_t*) NE10_MALLOC (kTransformSize * sizeof(ne10_fft_cpx_float32_t));
+		cepstrum = (ne10_fft_cpx_float32_t*) NE10_MALLOC (kTransformSize * sizeof(ne10_fft_cpx_float32_t));
+		cfg = fftPlanCache::acquireFloatPlan(kTransformSize);
+
+		for(int m = 0; m < kTransformSize; m++){
+			cosineTable[m] = cos(2 * M_PI * (float)m / (float)kTransformSize);
+		}
+		memset(logEnvelope, 0, sizeof(logEnvelope));
+	}
+
+	~formantEnvelope(){ // Destructor
+		NE10_FREE(timeDomain);
+		NE10_FREE(cepstrum);
+		fftPlanCache::release(cfg);
+	}
+
+	// Estimate the envelope of an amplitude spectrum of size bins, frequencyStep Hz apart
+	void analyse(const float* amplitudes, int size, float frequencyStep);
+
+	// Write the natural log of the envelope at each of bins bins, frequencyStep Hz apart
+	void fill(float* binEnvelope, int bins, float frequencyStep) const;
+
+private:
+	static const int kBands = 128; // Band centres run from 0Hz to kMaxFrequency in kBands steps
+	static const int kTransformSize = 2 * kBands; // The bands mirrored, so that the cepstrum is real
+	static const int kCoefficients = 32; // Cepstral coefficients kept. Fewer gives a smoother envelope
+	static constexpr float kMaxFrequency = 11025; // Formants above this don't matter for voices
+	static constexpr float kBandWidth = kMaxFrequency / kBands;
+
+	ne10_fft_cpx_float32_t* timeDomain;
+	ne10_fft_cpx_float32_t* cepstrum;
+	ne10_fft_cfg_float32_t cfg; // Shared with every other FFT of this size
+	float cosineTable[kTransformSize];
+	float logEnvelope[kBands + 1]; // Smoothed log amplitude at the centre of each band
+};
+
+// Estimate the envelope of an amplitude spectrum of size bins, frequencyStep Hz apart
+void formantEnvelope::analyse(const float* amplitudes, int size, float frequencyStep){
+
+	// Anything more than 100dB below the largest bin is treated as that level, so silence doesn't give huge gains
+	float largest = 0;
+	for(int i = 0; i < size; i++){
+		largest = fmaxf(largest, amplitudes[i]);
+	}
+	if(largest <= 0){
+		memset(logEnvelope, 0, sizeof(logEnvelope));
+		return;
+	}
+	float minimum = largest * 1e-5;
+
+	// Pool the amplitudes into bands, holding the last band past the top of the spectrum
+	float inverseStep = 1 / frequencyStep;
+	float previous = logf(minimum);
+	for(int b = 0; b <= kBands; b++){
+		float centre = b * kBandWidth;
+		int start = (int)ceilf((centre - kBandWidth) * inverseStep);
+		int end = (int)floorf((centre + kBandWidth) * inverseStep);
+		start = (start < 0) ? 0 : start;
+		end = (end > size - 1) ? size - 1 : end;
+		if(start > end){
+			// Bins wider than the band, or past the end of the spectrum
+			start = end = (int)(centre * inverseStep + 0.5);
+		}
+		if(start >= size){
+			timeDomain[b].r = previous;
+			continue;
+		}
+
+		float band = minimum;
+		for(int i = start; i <= end; i++){
+			band = fmaxf(band, amplitudes[i]);
+		}
+		previous = logf(band);
+		timeDomain[b].r = previous;
+	}
+
+	// Mirror the log spectrum so that its transform is real and even
+	for(int b = 1; b < kBands; b++){
+		timeDomain[kTransformSize - b].r = timeDomain[b].r;
+	}
+	for(int m = 0; m < kTransformSize; m++){
+		timeDomain[m].i = 0;
+	}
+	ne10_fft_c2c_1d_float32_neon(cepstrum, timeDomain, cfg, 0);
+
+	// Keep only the low quefrencies (lifter), and sum them back into the log envelope at each band
+	float scale = 1.0 / kTransformSize;
+	for(int b = 0; b <= kBands; b++){
+		float sum = cepstrum[0].r;
+		for(int q = 1; q < kCoefficients; q++){
+			sum += 2 * cepstrum[q].r * cosineTable[(q * b) % kTransformSize];
+		}
+		logEnvelope[b] = sum * scale;
+	}
+}
+
+// Write the natural log of the envelope at each of bins bins, frequencyStep Hz apart
+void formantEnvelope::fill(float* binEnvelope, int bins, float frequencyStep) const{
+	float bandsPerBin = frequencyStep / kBandWidth;
+	for(int k = 0; k < bins; k++){
+		float position = k * bandsPerBin;
+		if(position >= kBands){
+			binEnvelope[k] = logEnvelope[kBands];
+			continue;
+		}
+		int band = (int)position;
+		float fraction = position - band;
+		binEnvelope[k] = logEnvelope[band] + fraction * (logEnvelope[band + 1] - logEnvelope[band]);
+	}
+}
+
+#endif //FORMANTENVELOPE_H
@@ -0,0 +1,137 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef HOPSCHEDULER_H
+#define HOPSCHEDULER_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "lockFreeRing.h"
+
+// Hands hops from render() to the processing thread through a lock-free queue
+// Each hop carries a sequence number, the buffer positions it covers and a deadline: the frame at which
+// the first sample of its output will be played. Hops which start processing after their deadline are
+// handled by a policy, and every outcome is counted
+
+enum{ // What to do with a hop which starts after its deadline
+	LATE_HOP_PROCESS = 0, // Process it anyway, writing only the output which hasn't been played yet
+	LATE_HOP_DROP, // Skip it. The phase vocoder's neighbouring windows crossfade across the gap. PSOLA channels are bypassed
+	LATE_HOP_BYPASS // Write the unprocessed input for this hop instead. PSOLA channels run through PSOLA unshifted
+};
+
+enum{ // What happened to each hop
+	HOP_ON_TIME = 0,
+	HOP_PROCESSED_LATE,
+	HOP_DROPPED,
+	HOP_BYPASSED,
+	HOP_EXPIRED, // So late that all of its output had already been played
+	HOP_OVERFLOWED, // Lost because the queue was full
+	HOP_OUTCOMES
+};
+
+const char* kHopOutcomeNames[] = {"on time", "processed late", "dropped", "bypassed", "expired", "overflowed"};
+
+// A hop waiting to be processed
+struct hopRequest{
+	uint32_t sequence;
+	int inputPointer; // Input buffer write pointer when the hop was scheduled. The window ends here
+	int decimatedPointer; // The same for the decimated analysis buffer
+	uint64_t scheduledFrame; // Frame at which the hop was scheduled
+	uint64_t deadline; // Frame at which its output starts to be played
+};
+
+class hopScheduler{
+public:
+	hopScheduler(int hS, int wS, int bS, int capacity = 16):hopSize(hS), windowSize(wS), blockSize(bS), queue(capacity){ // Constructor, to be called in setup()
+		for(int i = 0; i < HOP_OUTCOMES; i++){
+			counters[i] = 0;
+		}
+	}
+
+	// ---- render() side ---- //
+
+	// Update the current frame. Call at the start of each render()
+	inline void setCurrentFrame(uint64_t frame){
+		currentFrame.store(frame, std::memory_order_release);
+	}
+
+	// Queue a hop whose window ends at inputPointer, scheduled after the input of frame was stored
+	// The output of the hop starts a hop after the end of its window, so it has one hop to be processed
+	inline void schedule(int inputPointer, int decimatedPointer, uint64_t frame){
+		hopRequest request;
+		request.sequence = nextSequence++;
+		request.inputPointer = inputPointer;
+		request.decimatedPointer = decimatedPointer;
+		request.scheduledFrame = frame;
+		request.deadline = frame + 1 + hopSize;
+		if(!queue.push(request)){
+			counters[HOP_OVERFLOWED]++;
+		}
+	}
+
+	// ---- Processing thread side ---- //
+
+	// Take the oldest waiting hop. Returns false if there are none
+	inline bool next(hopRequest& request){
+		return queue.pop(request);
+	}
+
+	// Look at the oldest waiting hop without taking it. Returns false if there are none
+	inline bool peek(hopRequest& request){
+		return queue.peek(request);
+	}
+
+	// How many frames late processing of a hop is starting, allowing for render() being part way through a block
+	// Negative if on time. Output samples before this have already been played
+	inline int lateness(const hopRequest& request){
+		return (int)((int64_t)currentFrame.load(std::memory_order_acquire) + blockSize - (int64_t)request.deadline);
+	}
+
+	// The frame render() was on when last called
+	inline uint64_t returnCurrentFrame(){
+		return currentFrame.load(std::memory_order_acquire);
+	}
+
+	// Decide what to do with a hop which is lateFrames late, given the late hop policy
+	inline int decide(int lateFrames, int policy){
+		if(lateFrames <= 0){
+			return HOP_ON_TIME;
+		}
+		if(lateFrames >= windowSize){
+			return HOP_EXPIRED;
+		}
+		if(policy == LATE_HOP_DROP){
+			return HOP_DROPPED;
+		}
+		if(policy == LATE_HOP_BYPASS){
+			return HOP_BYPASSED;
+		}
+		return HOP_PROCESSED_LATE;
+	}
+
+	// Count the outcome of a hop
+	inline void count(int outcome){
+		counters[outcome]++;
+	}
+
+	// Returns how many hops have had the given outcome
+	inline unsigned int returnCount(int outcome){
+		return counters[outcome].load();
+	}
+
+private:
+	const int hopSize;
+	const int windowSize;
+	const int blockSize;
+	lockFreeRing<hopRequest> queue;
+	uint32_t nextSequence = 0; // Only used by render()
+	std::atomic<uint64_t> currentFrame{0};
+	std::atomic<unsigned int> counters[HOP_OUTCOMES];
+};
+
+#endif //HOPSCHEDULER_H
\ No newline at end of file
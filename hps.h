@@ -12,6 +12,8 @@
 #include <math.h>
 
 #include "peakDetection.h"
+#include "fixedPoint.h"
+#include "formantEnvelope.h"
 
 // A harmonic product spectrum used for pitch detection
 
@@ -25,6 +27,11 @@ public:
 		productSpectrum = (float*) malloc (HPSSize * sizeof(float));
 		frequencyStep = (float)sampleRate / (float)(size); // Calculate the frequency step for each 
 		detectedPeaks = (int*)malloc(bufferSize * sizeof(int));
+		filteredProduct = (float*)malloc(HPSSize * sizeof(float));
+		fixedAmplitudeSpectrum = (ne10_int32_t*)malloc(bufferSize * sizeof(ne10_int32_t));
+		fixedProductSpectrum = (ne10_int32_t*)malloc(HPSSize * sizeof(ne10_int32_t));
+		residualSpectrum = (float*)malloc(bufferSize * sizeof(float));
+		residualProductSpectrum = (float*)malloc(HPSSize * sizeof(float));
 	}
 	
 	~HPS(){ // Destructor
@@ -33,6 +40,11 @@ public:
 		free(threeSigma);
 		free(productSpectrum);
 		free(detectedPeaks);
+		free(filteredProduct);
+		free(fixedAmplitudeSpectrum);
+		free(fixedProductSpectrum);
+		free(residualSpectrum);
+		free(residualProductSpectrum);
 		rt_printf("HPS deleted.\n");
 	}
 	
@@ -45,18 +57,55 @@ public:
 		}
 	}
 	
+	// Import data from a Q31 ne10 FFT frequency spectrum with the given block exponent
+	void importFixedPointSpectrum(ne10_fft_cpx_int32_t* spectrum, int exponent);
+	
 	// Calculate the HPS
 	void calculate();
 	
+	// Calculate the HPS in fixed point, from a spectrum imported with importFixedPointSpectrum
+	void calculateFixedPoint();
+	
 	// Find the peak in the product spectrum
 	int returnPeakLocation();
 	
+	// Smoothing lag and threshold (in standard deviations) of the peak detection on the product spectrum
+	// See tools/pitchBenchmark.cpp to compare settings
+	void setPeakDetection(int lag, float threshold){
+		peakLag = lag;
+		peakThreshold = threshold;
+	}
+	
+	// How much of the product spectrum is in the last peak found, from 0 to 1
+	float returnConfidence(){
+		return confidence;
+	}
+	
 	void exportHPS(std::string fileName, bool includeIntermediaries = false);
 	
 	// Return an estimate of the exact frequency of the incoming signal
 	float estimateFundamentalFrequency(int peakBin = 0);
 	
+	// Find up to maxVoices fundamentals, strongest first, for polyphonic correction
+	// peakBin from returnPeakLocation() is the first. Returns how many were found
+	int findFundamentals(int peakBin, float* frequencies, int maxVoices);
+	
+	// Estimate the formant envelope from the amplitude spectrum imported for this hop
+	void estimateEnvelope(formantEnvelope* envelope){
+		envelope->analyse(amplitudeSpectrum, bufferSize, frequencyStep);
+	}
+	
 private:
+	// Find the peak of a product spectrum, choosing between detected peaks by their amplitude in amplitudes
+	int findPeak(float* product, float* amplitudes, float& productSum);
+	
+	// Interpolate the frequency of a peak in amplitudes. Returns 0 below 50Hz
+	float interpolatePeak(float* amplitudes, int peakBin);
+	
+	// Remove the harmonics of a fundamental from residualSpectrum
+	void removeHarmonics(float frequency);
+	
+
 	float* amplitudeSpectrum;
 	float* twoSigma;
 	float* threeSigma;
@@ -66,8 +115,57 @@ private:
 	const int HPSSize;
 	float frequencyStep;
 	int* detectedPeaks;
+	float* filteredProduct; // Working space for detectPeaks()
+	ne10_int32_t* fixedAmplitudeSpectrum; // Q31 amplitudes, normalised to use the full range
+	ne10_int32_t* fixedProductSpectrum;
+	int fixedExponent; // Block exponent of fixedAmplitudeSpectrum
+	float confidence = 0;
+	int peakLag = 5;
+	float peakThreshold = 20;
+	
+	// Polyphonic detection works on a copy of the amplitude spectrum with the voices found so far removed
+	float* residualSpectrum;
+	float* residualProductSpectrum;
+	static const int kMaxHarmonics = 32;
+	float harmonicAmplitudes[kMaxHarmonics];
+	const float voiceThreshold = 0.01; // Weakest voice kept, as a share of the first voice's product
 };
 
+// Import data from a Q31 ne10 FFT frequency spectrum with the given block exponent
+void HPS::importFixedPointSpectrum(ne10_fft_cpx_int32_t* spectrum, int exponent){
+	
+	// Keep a guard bit so that the sum of squares fits in 64 bits
+	int shift = 1;
+	for(int i = 0; i < bufferSize; i++){
+		ne10_int32_t r = spectrum[i].r >> shift;
+		ne10_int32_t im = spectrum[i].i >> shift;
+		fixedAmplitudeSpectrum[i] = squareRoot64((int64_t)r * r + (int64_t)im * im);
+	}
+	fixedExponent = exponent + shift;
+	
+	// Use the full range before multiplying, so that quiet bins don't underflow in the product
+	fixedExponent -= normaliseBlock(fixedAmplitudeSpectrum, bufferSize, 0);
+	
+	// Peak picking and interpolation use the float amplitudes
+	for(int i = 0; i < bufferSize; i++){
+		amplitudeSpectrum[i] = q31ToFloat(fixedAmplitudeSpectrum[i], fixedExponent);
+	}
+}
+
+// Calculate the HPS in fixed point
+void HPS::calculateFixedPoint(){
+	for(int i = 0; i < HPSSize; i++){
+		fixedProductSpectrum[i] = multiplyQ31(multiplyQ31(fixedAmplitudeSpectrum[i], fixedAmplitudeSpectrum[i*2]), fixedAmplitudeSpectrum[i*3]);
+	}
+	
+	// The product of three values with exponent e has exponent 3e. Convert for peak detection
+	for(int i = 0; i < HPSSize; i++){
+		twoSigma[i] = amplitudeSpectrum[i*2];
+		threeSigma[i] = amplitudeSpectrum[i*3];
+		productSpectrum[i] = q31ToFloat(fixedProductSpectrum[i], 3 * fixedExponent);
+	}
+}
+
 // Calculate the HPS
 void HPS::calculate(){
 	for(int i = 0; i < HPSSize; i++){
@@ -77,8 +175,8 @@ void HPS::calculate(){
 	}
 }
 
-// Find the peak in the product spectrum
-int HPS::returnPeakLocation(){
+// Find the peak of a product spectrum, choosing between detected peaks by their amplitude in amplitudes
+int HPS::findPeak(float* product, float* amplitudes, float& productSum){
 	
 	int peakLocation = 0;
 	int peakAmplitude = 0; 
@@ -86,13 +184,15 @@ int HPS::returnPeakLocation(){
 	// Ignore values below 50Hz as they're noisy
 	int lowerLimit = ceil(50.0 / frequencyStep);
 	
-	detectPeaks(HPSSize, productSpectrum, detectedPeaks);
+	detectPeaks(HPSSize, product, detectedPeaks, filteredProduct, peakLag, peakThreshold);
 	
+	productSum = 0;
 	for(int i = lowerLimit; i < HPSSize; i++){
+		productSum += product[i];
 		if(detectedPeaks[i] == 1){
-			if(amplitudeSpectrum[i] > peakAmplitude){
+			if(amplitudes[i] > peakAmplitude){
 				peakLocation = i;
-				peakAmplitude = amplitudeSpectrum[i];
+				peakAmplitude = amplitudes[i];
 			}
 		}
 	}
@@ -100,18 +200,45 @@ int HPS::returnPeakLocation(){
 	return peakLocation;
 }
 
+// Find the peak in the product spectrum
+int HPS::returnPeakLocation(){
+	
+	float productSum;
+	int peakLocation = findPeak(productSpectrum, amplitudeSpectrum, productSum);
+	
+	// Confidence is the share of the product spectrum in the peak and its neighbours, within the range searched
+	confidence = 0;
+	if(peakLocation != 0 && productSum > 0){
+		int lowerLimit = ceil(50.0 / frequencyStep);
+		int below = (peakLocation - 1 < lowerLimit) ? lowerLimit : peakLocation - 1;
+		int above = (peakLocation + 1 > HPSSize - 1) ? HPSSize - 1 : peakLocation + 1;
+		for(int i = below; i <= above; i++){
+			confidence += productSpectrum[i];
+		}
+		confidence /= productSum;
+	}
+	
+	return peakLocation;
+}
+
 // Return an estimate of the exact frequency of the incoming signal
 float HPS::estimateFundamentalFrequency(int peakBin){
 	if(peakBin == 0){
 		peakBin = this->returnPeakLocation();
 	}
 	
+	return interpolatePeak(amplitudeSpectrum, peakBin);
+}
+
+// Interpolate the frequency of a peak in amplitudes. Returns 0 below 50Hz
+float HPS::interpolatePeak(float* amplitudes, int peakBin){
+	
 	// Quadratic interpolation
 	
 	// Find the amplitudes of the bins either side of the peak.
-	float alpha = amplitudeSpectrum[peakBin-1];
-	float beta  = amplitudeSpectrum[peakBin];
-	float gamma = amplitudeSpectrum[peakBin+1];
+	float alpha = amplitudes[peakBin-1];
+	float beta  = amplitudes[peakBin];
+	float gamma = amplitudes[peakBin+1];
 	
 	float relativePeakLocation = 0.5*(alpha - gamma)/(alpha - 2*beta + gamma); // Estimate where the peak is within the bins
 	
@@ -126,6 +253,87 @@ float HPS::estimateFundamentalFrequency(int peakBin){
 	return frequencyEstimation;
 }
 
+// Find up to maxVoices fundamentals, strongest first, by harmonic subtraction
+// After each fundamental is found its harmonics are removed from a copy of the amplitude spectrum and the HPS of what
+// remains is searched again. Voices much weaker than the first are ignored, as they are usually what's left of it
+int HPS::findFundamentals(int peakBin, float* frequencies, int maxVoices){
+	if(peakBin == 0 || maxVoices < 1){
+		return 0;
+	}
+	
+	// The first voice is the one found by returnPeakLocation()
+	float frequency = interpolatePeak(amplitudeSpectrum, peakBin);
+	if(frequency == 0){
+		return 0;
+	}
+	frequencies[0] = frequency;
+	float firstStrength = productSpectrum[peakBin];
+	memcpy(residualSpectrum, amplitudeSpectrum, bufferSize * sizeof(float));
+	
+	int voices = 1;
+	while(voices < maxVoices){
+		removeHarmonics(frequency);
+		
+		for(int i = 0; i < HPSSize; i++){
+			residualProductSpectrum[i] = residualSpectrum[i] * residualSpectrum[i*2] * residualSpectrum[i*3];
+		}
+		
+		float productSum;
+		peakBin = findPeak(residualProductSpectrum, residualSpectrum, productSum);
+		if(peakBin == 0 || residualProductSpectrum[peakBin] < voiceThreshold * firstStrength){
+			break;
+		}
+		frequency = interpolatePeak(residualSpectrum, peakBin);
+		if(frequency == 0){
+			break;
+		}
+		frequencies[voices++] = frequency;
+	}
+	
+	return voices;
+}
+
+// Remove the harmonics of a fundamental from residualSpectrum
+// Each harmonic is limited to the mean of itself and its neighbours before it is removed, as a voice's harmonics
+// change smoothly. A harmonic much louder than its neighbours is shared with another voice, and what's left is kept for it
+void HPS::removeHarmonics(float frequency){
+	float position = frequency / frequencyStep;
+	int harmonics = (bufferSize - 3) / position;
+	if(harmonics > kMaxHarmonics){
+		harmonics = kMaxHarmonics;
+	}
+	
+	for(int h = 0; h < harmonics; h++){
+		int centre = lrintf((h + 1) * position);
+		harmonicAmplitudes[h] = fmaxf(residualSpectrum[centre-1], fmaxf(residualSpectrum[centre], residualSpectrum[centre+1]));
+	}
+	
+	for(int h = 0; h < harmonics; h++){
+		float sum = harmonicAmplitudes[h];
+		int count = 1;
+		if(h > 0){
+			sum += harmonicAmplitudes[h-1];
+			count++;
+		}
+		if(h < harmonics - 1){
+			sum += harmonicAmplitudes[h+1];
+			count++;
+		}
+		if(harmonicAmplitudes[h] <= 0){
+			continue;
+		}
+		
+		// Scale the main lobe of the Hanning window around the harmonic down by the share that belongs to this voice
+		float share = fminf(sum / count, harmonicAmplitudes[h]) / harmonicAmplitudes[h];
+		int centre = lrintf((h + 1) * position);
+		for(int k = centre - 2; k <= centre + 2; k++){
+			if(k >= 0 && k < bufferSize){
+				residualSpectrum[k] *= 1 - share;
+			}
+		}
+	}
+}
+
 void HPS::exportHPS(std::string fileName, bool includeIntermediaries){
 	// Writes the HPS to a text file
 	
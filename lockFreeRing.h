@@ -0,0 +1,87 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef LOCKFREERING_H
+#define LOCKFREERING_H
+
+#include <atomic>
+
+// A single-producer, single-consumer lock-free queue of fixed-size items
+// One thread may push and another may pop without locks, so it can be used from real-time threads
+// Storage is allocated up front. Capacity is rounded up to a power of two
+
+template <typename T>
+class lockFreeRing{
+public:
+	lockFreeRing(int requestedCapacity){ // Constructor
+		capacity = 1;
+		while(capacity < (unsigned int)requestedCapacity){
+			capacity <<= 1;
+		}
+		mask = capacity - 1;
+		storage = (T*)malloc(capacity * sizeof(T));
+	}
+
+	~lockFreeRing(){ // Destructor
+		free(storage);
+	}
+
+	// Add an item. Returns false, dropping the item, if the ring is full. Producer thread only
+	inline bool push(const T& item){
+		unsigned int write = writeIndex.load(std::memory_order_relaxed);
+		unsigned int read = readIndex.load(std::memory_order_acquire);
+		if(write - read >= capacity){
+			return false;
+		}
+		storage[write & mask] = item;
+		writeIndex.store(write + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Remove the oldest item. Returns false if the ring is empty. Consumer thread only
+	inline bool pop(T& item){
+		unsigned int read = readIndex.load(std::memory_order_relaxed);
+		unsigned int write = writeIndex.load(std::memory_order_acquire);
+		if(read == write){
+			return false;
+		}
+		item = storage[read & mask];
+		readIndex.store(read + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Copy the oldest item without removing it. Returns false if the ring is empty. Consumer thread only
+	// Lets the consumer finish with storage referred to by the item before the producer can reuse it
+	inline bool peek(T& item){
+		unsigned int read = readIndex.load(std::memory_order_relaxed);
+		unsigned int write = writeIndex.load(std::memory_order_acquire);
+		if(read == write){
+			return false;
+		}
+		item = storage[read & mask];
+		return true;
+	}
+
+	// Number of items waiting
+	inline int size(){
+		return writeIndex.load(std::memory_order_acquire) - readIndex.load(std::memory_order_acquire);
+	}
+
+	// Maximum number of items, after rounding
+	inline int returnCapacity(){
+		return capacity;
+	}
+
+private:
+	unsigned int capacity;
+	unsigned int mask;
+	T* storage;
+	std::atomic<unsigned int> writeIndex{0}; // Indices run freely and are masked on access
+	std::atomic<unsigned int> readIndex{0};
+};
+
+#endif //LOCKFREERING_H
\ No newline at end of file
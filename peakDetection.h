@@ -9,35 +9,36 @@
 #ifndef PEAKDETECTION_H
 #define PEAKDETECTION_H
 
-#include <vector>
-#include <numeric>
+#include <string.h>
+#include <cmath>
 
 // A peak detection algorithm
-// outputData must be an int array of equal size to inputData
+// outputData must be an int array of equal size to inputData, and filteredData a float array of the same size, which is
+// used as working space so that nothing is allocated on the audio threads
+// lag is the number of previous values the mean and deviation are taken over, and a value is a peak
+// when it is more than signalThreshold standard deviations from that mean
 
-float mean(std::vector<float> vec){
-	float sum = std::accumulate(std::begin(vec), std::end(vec), 0.0);
-	return sum / vec.size();
+float mean(const float* data, int size){
+	double total = 0; // Summed in double precision, then rounded
+	for(int i = 0; i < size; i++){
+		total += data[i];
+	}
+	float sum = total;
+	return sum / size;
 }
 
-float standardDeviation(std::vector<float> vec){
-	float m = mean(vec); // Obtain mean
+float standardDeviation(const float* data, int size){
+	float m = mean(data, size); // Obtain mean
 	
 	float temp = 0;
-	for(int i = 0; i < vec.size(); i++){ // Sum the squares of the deviations from the mean
-		temp += (vec[i] - m) * (vec[i] - m);
+	for(int i = 0; i < size; i++){ // Sum the squares of the deviations from the mean
+		temp += (data[i] - m) * (data[i] - m);
 	}
-	float stdDev = sqrt(temp / (vec.size() - 1)); // Divide by number of samples -1, then sqrt to get standard deviation
+	float stdDev = sqrt(temp / (size - 1)); // Divide by number of samples -1, then sqrt to get standard deviation
 	return stdDev;
 }
 
-void detectPeaks(int inputSize, float* inputData, int* outputData){
-
-	// Smoothing coefficient
-	int lag = 5; 
-	
-	// Theshold for signal in standard deviations from the mean.
-	float signalThreshold = 20;
+void detectPeaks(int inputSize, float* inputData, int* outputData, float* filteredData, int lag = 5, float signalThreshold = 20){
 	
 	// Between 0 and 1
 	float influence = 0;
@@ -51,13 +52,13 @@ void detectPeaks(int inputSize, float* inputData, int* outputData){
 		return;
 	}
 	
-	std::vector<float> filteredY(inputSize, 0.0); // Use a vector to allow dynamic declaration at runtime
-	std::vector<float> avgFilter(inputSize, 0.0);
-	std::vector<float> stdFilter(inputSize, 0.0);
-	std::vector<float> subVecStart(inputData[0], inputData[0] + lag);
+	// Only the filters of the previous value are needed
+	memset(filteredData, 0, inputSize * sizeof(float));
+	float avgFilter = 0;
+	float stdFilter = 0;
 	
 	for(int i = lag + 1; i < inputSize; i++){
-		if(std::abs(inputData[i] - avgFilter[i-1]) > signalThreshold * stdFilter[i-1]){
+		if(std::abs(inputData[i] - avgFilter) > signalThreshold * stdFilter){
 			if(inputData[i] > 0.1){
 				outputData[i] = 1; // Positive signal
 			}
@@ -65,16 +66,15 @@ void detectPeaks(int inputSize, float* inputData, int* outputData){
 				outputData[i] = 0;
 			}
 			// Reduce influence
-			filteredY[i] = influence * inputData[i] + (1-influence) * filteredY[i-1];
+			filteredData[i] = influence * inputData[i] + (1-influence) * filteredData[i-1];
 		}
 		else{
 			outputData[i] = 0; // No signal
 		}
 		
 		// Adjust filters
-		std::vector<float> subVec(filteredY.begin() + i - lag, filteredY.begin() + i); // Temporary vector to store the last lag entries for calculations
-		avgFilter[i] = mean(subVec); // Take mean of last lag values
-		stdFilter[i] = standardDeviation(subVec); // Take standard deviations of last lag values
+		avgFilter = mean(filteredData + i - lag, lag); // Take mean of last lag values
+		stdFilter = standardDeviation(filteredData + i - lag, lag); // Take standard deviations of last lag values
 	}
 }
 
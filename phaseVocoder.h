@@ -1,6 +1,5 @@
-/***** phaseVocoder.h *****/
 /*
- * Written for ECS7012U Music and 
+ * Written for ECS7012U Music and
  * Audio Programming, for the Bela platform.
  *
  * Alex Richardson 2020
@@ -9,97 +8,296 @@
 #ifndef PHASEVOCODER_H
 #define PHASEVOCODER_H
 
-// Multiply two complex numbers together
-void complexMultiply(float realA, float complexA, float realB, float complexB, float* output);
+#include "fastMath.h"
+#include "formantEnvelope.h"
 
-// A phase vocoder for adjusting the pitch of incoming audio
+// A phase-locked phase vocoder for adjusting the pitch of incoming audio
+// Every bin is shifted. Spectral peaks are moved to their new frequency and the bins around
+// each peak (its region of influence) move with it, with their phases locked to the peak's
+// Each stage is a separate loop over preallocated arrays so that it can be vectorised
+// Given a formantEnvelope, each moved bin is scaled by the envelope at its destination over the envelope at its source,
+// so the formants stay where they were instead of moving with the pitch
 class phaseVocoder{
 public:
-	phaseVocoder(int s, int hS, int sr):size(s), hopSize(hS), sampleRate(sr){ // Constructor
+	phaseVocoder(int s, int hS, int sr):size(s), hopSize(hS), sampleRate(sr), bins(s/2 + 1){ // Constructor
 		frequencyStep = (float)sampleRate / (float)(size); // Calculate the frequency step
 		inverseFrequencyStep = 1/frequencyStep; // Cache the inverse for efficiency
-		cachedPhaseShift = (float*) malloc (2 * sizeof(float));
-		memset(cachedPhaseShift, 0, 2 * sizeof(float));
-		complexMultiplied = (float*) malloc ( 2 * sizeof(float));
-		memset(complexMultiplied, 0, 2 * sizeof(float));
+
+		real = (float*) malloc (bins * sizeof(float));
+		imaginary = (float*) malloc (bins * sizeof(float));
+		magnitude = (float*) malloc (bins * sizeof(float));
+		phase = (float*) malloc (bins * sizeof(float));
+		previousPhase = (float*) malloc (bins * sizeof(float));
+		phaseAdvance = (float*) malloc (bins * sizeof(float));
+		expectedAdvance = (float*) malloc (bins * sizeof(float));
+		outputMagnitude = (float*) malloc (bins * sizeof(float));
+		outputPhase = (float*) malloc (bins * sizeof(float));
+		previousOutputPhase = (float*) malloc (bins * sizeof(float));
+		peaks = (int*) malloc (bins * sizeof(int));
+		peakRatios = (float*) malloc (bins * sizeof(float));
+		binEnvelope = (float*) malloc (bins * sizeof(float));
+
+		memset(previousPhase, 0, bins * sizeof(float));
+		memset(previousOutputPhase, 0, bins * sizeof(float));
+
+		// The phase each bin's centre frequency advances by over a hop
+		for(int k = 0; k < bins; k++){
+			expectedAdvance[k] = 2 * M_PI * (float)k * (float)hopSize / (float)size;
+		}
 	}
 	~phaseVocoder(){ // Destructor
-		free(cachedPhaseShift);
-		free(complexMultiplied);
+		free(real);
+		free(imaginary);
+		free(magnitude);
+		free(phase);
+		free(previousPhase);
+		free(phaseAdvance);
+		free(expectedAdvance);
+		free(outputMagnitude);
+		free(outputPhase);
+		free(previousOutputPhase);
+		free(peaks);
+		free(peakRatios);
+		free(binEnvelope);
 	}
+
+	// Shift the whole spectrum so that currentFrequency moves to desiredFrequency
+	// If peakBin is 0 there is no valid pitch, and the spectrum is resynthesised unshifted to keep phases continuous
+	// If envelope is given, the formants are kept in place
+	void shiftFrequency(ne10_fft_cpx_float32_t* frequencySpectrum, int peakBin, float currentFrequency, float desiredFrequency,
+		const formantEnvelope* envelope = nullptr);
 	
-	// Shift the peak at the given location
-	void shiftFrequency(ne10_fft_cpx_float32_t* frequencySpectrum, int peakBin, float currentFrequency, float desiredFrequency);
-	
+	// Shift the harmonics of each of several voices so that its currentFrequencies moves to its desiredFrequencies
+	// Peaks that aren't a harmonic of any voice are resynthesised unshifted
+	void shiftVoices(ne10_fft_cpx_float32_t* frequencySpectrum, int voices, float* currentFrequencies, float* desiredFrequencies,
+		const formantEnvelope* envelope = nullptr);
+
+	// Forget the phases of previous hops, to start on unrelated audio
+	void reset(){
+		memset(previousPhase, 0, bins * sizeof(float));
+		memset(previousOutputPhase, 0, bins * sizeof(float));
+	}
+
+	// The lowest fundamental whose harmonics this window separates into their own peaks
+	// Below it neighbouring harmonics share peaks and regions of influence, so they move by different amounts
+	float returnMinimumFrequency(){
+		return kMinimumHarmonicBins * frequencyStep;
+	}
+
+	// Take the output phases from the input again at the next hop, instead of continuing from the last hop
+	// Two vocoders fed the same audio give the same output after a restart, whatever they processed before
+	void restartPhase(){
+		phaseRestart = true;
+	}
+
 private:
+	// Convert the spectrum into magnitudes, phases and phase advances
+	void analyse(ne10_fft_cpx_float32_t* frequencySpectrum);
+
+	// Find the spectral peaks, returning how many were found
+	int findPeaks();
+
+	// Move each peak and its region of influence by its ratio in peakRatios, correcting for the envelope if there is one
+	void shiftPeaks(int peakCount, const formantEnvelope* envelope);
+
+	// Convert the output magnitudes and phases back into a mirrored spectrum
+	void synthesise(ne10_fft_cpx_float32_t* frequencySpectrum);
+
 	float frequencyStep;
 	float inverseFrequencyStep;
 	const int size;
 	const int hopSize;
 	const int sampleRate;
-	float* cachedPhaseShift;
-	float* complexMultiplied;
+	const int bins; // Number of unique bins in the spectrum of a real signal
+
+	float* real;
+	float* imaginary;
+	float* magnitude;
+	float* phase;
+	float* previousPhase; // Analysis phases from the previous hop
+	float* phaseAdvance; // Measured phase advance of each bin over the last hop
+	float* expectedAdvance;
+	float* outputMagnitude;
+	float* outputPhase;
+	float* previousOutputPhase; // Synthesis phases from the previous hop
+	int* peaks;
+	float* peakRatios; // Ratio each peak is shifted by
+	float* binEnvelope; // Log formant envelope at each bin
+	bool phaseRestart = false;
+	static constexpr float kMaxFormantGain = 2.77; // Largest envelope correction, about 24dB
+	static constexpr float kMinimumHarmonicBins = 3.5; // Harmonic spacing needed to shift cleanly, measured with a Hanning window
 };
 
-// Shift the peak at the given location
-void phaseVocoder::shiftFrequency(ne10_fft_cpx_float32_t* frequencySpectrum, int peakBin, float currentFrequency, float desiredFrequency){
-	
-	// Ensure bin is valid
-	if(peakBin == 0){
-		return;
+// Shift the whole spectrum so that currentFrequency moves to desiredFrequency
+void phaseVocoder::shiftFrequency(ne10_fft_cpx_float32_t* frequencySpectrum, int peakBin, float currentFrequency, float desiredFrequency,
+	const formantEnvelope* envelope){
+
+	// Ratio the spectrum must be scaled by
+	float ratio = 1;
+	if(peakBin != 0 && currentFrequency > 0 && desiredFrequency > 0){
+		ratio = desiredFrequency / currentFrequency;
 	}
+
+	analyse(frequencySpectrum);
+	int peakCount = findPeaks();
+	for(int p = 0; p < peakCount; p++){
+		peakRatios[p] = ratio;
+	}
+	shiftPeaks(peakCount, envelope);
+	synthesise(frequencySpectrum);
+}
+
+// Shift the harmonics of each of several voices so that its currentFrequencies moves to its desiredFrequencies
+void phaseVocoder::shiftVoices(ne10_fft_cpx_float32_t* frequencySpectrum, int voices, float* currentFrequencies, float* desiredFrequencies,
+	const formantEnvelope* envelope){
 	
-	// Find the frequency shift that must be performed
-	// The number of bins we need to shift by
-	float frequencyShift = (desiredFrequency - currentFrequency) * inverseFrequencyStep; // Amount that the frequency needs to be shifted by
+	analyse(frequencySpectrum);
+	int peakCount = findPeaks();
 	
-	// The phase of the sample will need to be corrected to remove artifacting
-	// The phase shift is cumulated between FFTs
-	if(cachedPhaseShift[0] == 0 && cachedPhaseShift[1] == 0){
-		cachedPhaseShift[0] = cos(frequencyShift * hopSize);
-		cachedPhaseShift[1] = sin(frequencyShift * hopSize);
-	}
-	else{
-		complexMultiply(cachedPhaseShift[0], cachedPhaseShift[1], cos(frequencyShift*hopSize), sin(frequencyShift*hopSize), cachedPhaseShift);
-		while(cachedPhaseShift[0] > M_PI*hopSize){ // Wrap phase
-			cachedPhaseShift[0] -= 2*M_PI*hopSize;
-		}
-		while(cachedPhaseShift[1] > M_PI*hopSize){
-			cachedPhaseShift[1] -= 2*M_PI*hopSize;
+	// Each peak belongs to the voice with a harmonic nearest to it, if one is within 1.5 bins
+	for(int p = 0; p < peakCount; p++){
+		peakRatios[p] = 1;
+		float nearest = 1.5;
+		for(int v = 0; v < voices; v++){
+			if(currentFrequencies[v] <= 0 || desiredFrequencies[v] <= 0){
+				continue;
+			}
+			float fundamentalBin = currentFrequencies[v] * inverseFrequencyStep;
+			float harmonic = roundf(peaks[p] / fundamentalBin);
+			float distance = fabsf(peaks[p] - harmonic * fundamentalBin);
+			if(harmonic >= 1 && distance < nearest){
+				nearest = distance;
+				peakRatios[p] = desiredFrequencies[v] / currentFrequencies[v];
+			}
 		}
 	}
 	
-	// Use linear interpolation to shift the peak
-	for(int i = peakBin-2; i < peakBin+3; i++){
-		frequencySpectrum[i].r = (ne10_float32_t)(1.0 - frequencyShift) * frequencySpectrum[i].r + (ne10_float32_t)frequencyShift * frequencySpectrum[i+1].r;
-		frequencySpectrum[i].i = (ne10_float32_t)(1.0 - frequencyShift) * frequencySpectrum[i].i + (ne10_float32_t)frequencyShift * frequencySpectrum[i+1].i;
+	shiftPeaks(peakCount, envelope);
+	synthesise(frequencySpectrum);
+}
 
-		// Correct the phase by multiplying the corrected frequency spectrum by the phase shift
-		complexMultiply(frequencySpectrum[i].r, frequencySpectrum[i].i, (ne10_float32_t)cachedPhaseShift[0], (ne10_float32_t)cachedPhaseShift[1], complexMultiplied);
-		frequencySpectrum[i].r = (ne10_float32_t)complexMultiplied[0];
-		frequencySpectrum[i].i = (ne10_float32_t)complexMultiplied[1];
+// Convert the spectrum into magnitudes, phases and phase advances
+void phaseVocoder::analyse(ne10_fft_cpx_float32_t* frequencySpectrum){
+
+	// Deinterleave so the following loops work on contiguous arrays
+	for(int k = 0; k < bins; k++){
+		real[k] = frequencySpectrum[k].r;
+		imaginary[k] = frequencySpectrum[k].i;
 	}
-	
-	// Mirror the spectrum
-	for(int i = 0; i < size/2; i++){
-		frequencySpectrum[size-i].r = frequencySpectrum[i].r;
-		frequencySpectrum[size-i].i = frequencySpectrum[i].i;
+
+	for(int k = 0; k < bins; k++){
+		magnitude[k] = sqrtf(real[k] * real[k] + imaginary[k] * imaginary[k]);
+		phase[k] = fastAtan2(imaginary[k], real[k]);
+	}
+
+	// The deviation from the expected advance gives each bin's true frequency
+	for(int k = 0; k < bins; k++){
+		float deviation = wrapPhase(phase[k] - previousPhase[k] - expectedAdvance[k]);
+		phaseAdvance[k] = expectedAdvance[k] + deviation;
+		previousPhase[k] = phase[k];
 	}
-	
 }
 
+// Find the spectral peaks, returning how many were found
+int phaseVocoder::findPeaks(){
 
-// Multiply two complex numbers together
-void complexMultiply(float realA, float complexA, float realB, float complexB, float* output){
-	
-	float ac = realA * realB;
-	float bidi = complexA * complexB;
-	float bci = complexA * realB;
-	float adi = realA * complexB;
+	float largest = 0;
+	for(int k = 0; k < bins; k++){
+		largest = fmaxf(largest, magnitude[k]);
+	}
+
+	// Ignore anything more than 80dB below the largest bin
+	float threshold = largest * 1e-4;
+
+	int peakCount = 0;
+	for(int k = 2; k < bins - 2; k++){
+		float m = magnitude[k];
+		if(m > threshold && m > magnitude[k-1] && m >= magnitude[k+1] && m > magnitude[k-2] && m >= magnitude[k+2]){
+			peaks[peakCount++] = k;
+		}
+	}
+
+	return peakCount;
+}
+
+// Move each peak and its region of influence by its ratio in peakRatios, correcting for the envelope if there is one
+void phaseVocoder::shiftPeaks(int peakCount, const formantEnvelope* envelope){
+
+	memset(outputMagnitude, 0, bins * sizeof(float));
+	memset(outputPhase, 0, bins * sizeof(float));
 	
-	output[0] = ac - bidi;
-	output[1] = bci + adi;
+	if(envelope){
+		envelope->fill(binEnvelope, bins, frequencyStep);
+	}
+
+	for(int p = 0; p < peakCount; p++){
+		int peak = peaks[p];
+		float ratio = peakRatios[p];
+
+		// The region of influence extends halfway to the neighbouring peaks
+		int regionStart = (p == 0) ? 0 : (peaks[p-1] + peak + 1) / 2;
+		int regionEnd = (p == peakCount - 1) ? bins : (peak + peaks[p+1] + 1) / 2;
+
+		// Move the peak to the nearest bin to its new frequency
+		int target = (int)(peak * ratio + 0.5);
+		if(target <= 0 || target >= bins){
+			continue;
+		}
+		int shift = target - peak;
+
+		// The new phase of the peak advances at the shifted frequency, continuing from the last hop
+		// Every bin in the region is rotated by the same amount, locking it to the peak
+		float rotation = previousOutputPhase[target] + ratio * phaseAdvance[peak] - phase[peak];
+		if(phaseRestart){
+			rotation = 0;
+		}
+
+		// Keep the destination inside the spectrum
+		if(regionStart + shift < 0){
+			regionStart = -shift;
+		}
+		if(regionEnd + shift > bins){
+			regionEnd = bins - shift;
+		}
+
+		if(envelope && shift != 0){
+			// Scale by the envelope at the destination over the envelope at the source, limited to kMaxFormantGain (in nepers)
+			for(int k = regionStart; k < regionEnd; k++){
+				float gain = fminf(fmaxf(binEnvelope[k + shift] - binEnvelope[k], -kMaxFormantGain), kMaxFormantGain);
+				outputMagnitude[k + shift] += magnitude[k] * expf(gain);
+				outputPhase[k + shift] = wrapPhase(phase[k] + rotation);
+			}
+		}
+		else{
+			for(int k = regionStart; k < regionEnd; k++){
+				outputMagnitude[k + shift] += magnitude[k];
+				outputPhase[k + shift] = wrapPhase(phase[k] + rotation);
+			}
+		}
+	}
+
+	memcpy(previousOutputPhase, outputPhase, bins * sizeof(float));
+	phaseRestart = false;
 }
 
+// Convert the output magnitudes and phases back into a mirrored spectrum
+void phaseVocoder::synthesise(ne10_fft_cpx_float32_t* frequencySpectrum){
+
+	for(int k = 0; k < bins; k++){
+		real[k] = outputMagnitude[k] * fastCos(outputPhase[k]);
+		imaginary[k] = outputMagnitude[k] * fastSin(outputPhase[k]);
+	}
+
+	for(int k = 0; k < bins; k++){
+		frequencySpectrum[k].r = real[k];
+		frequencySpectrum[k].i = imaginary[k];
+	}
+
+	// Mirror the spectrum. The upper half is the complex conjugate of the lower half for a real signal
+	for(int k = 1; k < bins - 1; k++){
+		frequencySpectrum[size-k].r = real[k];
+		frequencySpectrum[size-k].i = -imaginary[k];
+	}
+}
 
 #endif // PHASEVOCODER_H
\ No newline at end of file
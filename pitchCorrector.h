@@ -0,0 +1,119 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef PITCHCORRECTOR_H
+#define PITCHCORRECTOR_H
+
+#include "correctionChannel.h"
+
+// One channel of pitch correction, fed a sample at a time, for the offline and streaming tools
+// The processing is render()'s own correctionChannel. Hops are processed as soon as they are due rather than on an
+// auxiliary thread, but the output is placed the same way, so the latency is a window and a hop as in render()
+// Unlike render(), the output is scaled back to unity gain so that it can be written to files
+class pitchCorrector{
+public:
+	pitchCorrector(const correctionConfig& config)
+	:hopSize(config.hopSize){ // Constructor
+		correctionConfig channelConfig = config;
+
+		// The buffers only need to hold the longest window and the output a window and a hop ahead of it
+		int detectionWindowSize = (config.detectionWindowSize > config.windowSize) ? config.detectionWindowSize : config.windowSize;
+		channelConfig.bufferSize = 4 * detectionWindowSize;
+		channel = new correctionChannel(channelConfig);
+
+		// Hanning windows overlap-added every hopSize samples sum to windowSize / (2 * hopSize)
+		outputScale = 2.0 * (float)config.hopSize / (float)config.windowSize;
+
+		reset();
+	}
+
+	~pitchCorrector(){ // Destructor
+		delete channel;
+	}
+
+	// Scale and key (in semitones above C) to correct to
+	void setScale(int s){
+		controls.scale = s;
+	}
+
+	void setKey(int k){
+		controls.key = k;
+	}
+
+	// Share of the correction applied, from 0 (none) to 1 (snap to the note)
+	void setStrength(float strength){
+		controls.strength = strength;
+	}
+
+	// Hops between pitch detections. The hops in between reuse the last pitch
+	void setAnalysisInterval(int interval){
+		analysisInterval = (interval < 1) ? 1 : interval;
+	}
+
+	// Peak detection settings for the pitch detector - see HPS::setPeakDetection()
+	void setPeakDetection(int lag, float threshold){
+		channel->setPeakDetection(lag, threshold);
+	}
+
+	// Clear all state, to start on unrelated audio
+	void reset(){
+		channel->reset();
+		hopCounter = 0;
+		hopsUntilAnalysis = 0;
+	}
+
+	// Process one sample. The output is delayed by returnLatency() samples
+	inline float process(float in){
+		channel->insert(in);
+		float out = channel->returnAndEmptyNextElement() * outputScale;
+
+		hopCounter++;
+		if(hopCounter >= hopSize){
+			bool analyse = (hopsUntilAnalysis <= 0);
+			hopsUntilAnalysis = analyse ? analysisInterval - 1 : hopsUntilAnalysis - 1;
+			channel->processHop(channel->returnInputPointer(), channel->returnDecimatedPointer(), 0, analyse, controls, record);
+			hopCounter = 0;
+		}
+		return out;
+	}
+
+	// Samples between a sample going in and its corrected version coming out
+	int returnLatency(){
+		return channel->returnLatency();
+	}
+
+	// The lowest fundamental the engine can correct on this window. Lower pitches are passed through unshifted
+	float returnMinimumFrequency(){
+		return channel->returnMinimumFrequency();
+	}
+
+	// Hops passed through unshifted because their fundamental was below returnMinimumFrequency()
+	int returnHopsBelowRange(){
+		return channel->returnHopsBelowRange();
+	}
+
+	// Pitch detected in the last hop, and the note it was corrected to
+	float returnFundamentalFrequency(){
+		return channel->returnFundamentalFrequency();
+	}
+
+	float returnDesiredNote(){
+		return channel->returnDesiredNote();
+	}
+
+private:
+	correctionChannel* channel;
+	correctionControls controls;
+	telemetryRecord record = {}; // Filled in by each hop, and not used
+	const int hopSize;
+	int hopCounter;
+	int analysisInterval = 1;
+	int hopsUntilAnalysis;
+	float outputScale;
+};
+
+#endif //PITCHCORRECTOR_H
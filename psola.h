@@ -0,0 +1,197 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef PSOLA_H
+#define PSOLA_H
+
+#include <math.h>
+
+#include "circularBuffer.h"
+#include "fftPlanCache.h"
+
+// Time-domain pitch-synchronous overlap-add (TD-PSOLA)
+// Corrects the pitch of monophonic sources without an FFT/IFFT, using only the detected pitch period
+// Grains two periods long are cut around analysis pitch marks and overlap-added at the desired period
+// Reads from and writes into the same circular buffers, with the same latency, as the phase vocoder path
+// Grains longer than the window allows are cut from up to history samples of earlier input, such as the rest of a
+// longer pitch detection window. The analysis marks then trail the synthesis marks, delaying those pitches by a lag
+
+class psola{
+public:
+	psola(int wS, int hS, int sr, int h = 0, float minimumFrequency = 50):windowSize(wS), hopSize(hS), sampleRate(sr), history(h){ // Constructor, to be called in setup()
+		maxPeriod = ceil((float)sampleRate / minimumFrequency);
+		longestPeriod = maxPeriod;
+
+		// Grains must fit either side of the synthesis region within the window
+		if(hopSize + 2 * maxPeriod > windowSize){
+			maxPeriod = (windowSize - hopSize) / 2;
+		}
+
+		// Longer grains are placed a period into the output and trail it by a lag (see process()). Their marks can land
+		// half a period early, so they need 3.25 periods and a hop of the window and its history
+		if(hopSize + 3.25 * longestPeriod > windowSize + history){
+			longestPeriod = (windowSize + history - hopSize) / 3.25;
+		}
+		if(longestPeriod < maxPeriod){
+			longestPeriod = maxPeriod;
+		}
+		minPeriod = sampleRate / 2000;
+		unvoicedPeriod = sampleRate / 100;
+
+		// Match the gain of a Hanning-windowed overlap-add at this hop size
+		outputGain = (float)windowSize / (2.0 * (float)hopSize);
+
+		// The grain window table is shared by every PSOLA engine
+		grainWindow = fftPlanCache::acquirePeriodicHanningWindow(kGrainWindowSize);
+	}
+
+	~psola(){ // Destructor
+		fftPlanCache::release(grainWindow);
+		rt_printf("PSOLA deleted.\n");
+	}
+
+	// Process one hop
+	// inputPointer is the input write pointer when the hop was scheduled, outputPointer is where the window starts in the output buffer
+	// If either frequency is 0, or currentFrequency is below returnMinimumFrequency(), the input is passed through without shifting
+	// Output before firstOutputSample (relative to outputPointer) has already been played, so isn't written
+	void process(circularBuffer* input, circularBuffer* output, int inputPointer, int outputPointer, float currentFrequency, float desiredFrequency, int firstOutputSample = 0);
+
+	// The lowest fundamental whose grains (two periods) fit in the window and its history alongside a hop
+	float returnMinimumFrequency(){
+		return (float)sampleRate / (float)longestPeriod;
+	}
+
+	// Forget the pitch marks, to start on unrelated audio
+	void reset(){
+		analysisMark = 0;
+		synthesisMark = 0;
+	}
+
+private:
+	// Find the largest sample near a predicted pitch mark
+	float findPitchMark(circularBuffer* input, int windowStart, float predictedMark, int period);
+
+	// Window a grain centred on analysisCentre and add it to the output centred on synthesisCentre
+	void overlapAddGrain(circularBuffer* input, circularBuffer* output, int windowStart, int outputPointer, int analysisCentre, int synthesisCentre, int halfLength, float gain, int firstOutputSample);
+
+	static const int kGrainWindowSize = 1024; // Resolution of the grain window table
+
+	const int windowSize;
+	const int hopSize;
+	const int sampleRate;
+	const int history; // Samples before the window which grains can be cut from
+	int maxPeriod; // Longest period whose grains fit in the window
+	int longestPeriod; // Longest period whose grains fit in the window and its history
+	int minPeriod;
+	int unvoicedPeriod; // Period used to keep overlap-adding while no pitch is detected
+	float outputGain;
+	const float* grainWindow;
+
+	// Pitch marks are held relative to the start of the current window
+	float analysisMark = 0;
+	float synthesisMark = 0;
+};
+
+// Process one hop
+void psola::process(circularBuffer* input, circularBuffer* output, int inputPointer, int outputPointer, float currentFrequency, float desiredFrequency, int firstOutputSample){
+
+	int windowStart = inputPointer - windowSize;
+
+	// Convert the frequencies into periods in samples
+	float analysisPeriod = unvoicedPeriod;
+	float synthesisPeriod = unvoicedPeriod;
+	if(currentFrequency > 0 && desiredFrequency > 0){
+		analysisPeriod = (float)sampleRate / currentFrequency;
+		synthesisPeriod = (float)sampleRate / desiredFrequency;
+	}
+	analysisPeriod = fmin(fmax(analysisPeriod, minPeriod), longestPeriod);
+	synthesisPeriod = fmin(fmax(synthesisPeriod, minPeriod), longestPeriod);
+
+	// Grains can't be cut around periods longer than longestPeriod, so those aren't shifted
+	// Each grain is taken from where it is placed, which overlap-adds the input as it is
+	bool unshifted = (currentFrequency > 0 && currentFrequency < returnMinimumFrequency());
+	if(unshifted){
+		synthesisPeriod = analysisPeriod;
+	}
+
+	// The window has moved on by a hop since the marks were placed
+	analysisMark -= hopSize;
+	synthesisMark -= hopSize;
+
+	// Synthesis marks are placed in this region, which leaves room for a full grain either side
+	// Grains longer than the window allows start a grain into the output, so that none of them has been played
+	int windowRegionStart = windowSize - hopSize - maxPeriod;
+	int halfLength = (int)analysisPeriod;
+	int regionStart = (windowRegionStart < halfLength) ? halfLength : windowRegionStart;
+	int regionEnd = regionStart + hopSize;
+
+	// Analysis marks trail the synthesis marks by the lag, so that the grains around them have all been input
+	// A mark lands up to three quarters of a period past its target, and its grain reaches a period further
+	float lag = fmax(regionEnd + 1.75 * analysisPeriod - windowSize, 0);
+
+	// Resynchronise after the first hop or a gap
+	// The last grain's analysis mark is normally up to a synthesis period and half an analysis period behind the next
+	// synthesis mark. Searching afresh any sooner finds marks out of step with the last one
+	if(synthesisMark < windowRegionStart - maxPeriod){
+		synthesisMark = regionStart;
+	}
+	if(analysisMark < synthesisMark - lag - synthesisPeriod - analysisPeriod){
+		analysisMark = findPitchMark(input, windowStart, synthesisMark - lag, analysisPeriod);
+	}
+
+	// Normalise for the grain overlap, which depends on the ratio of the periods
+	float gain = outputGain * synthesisPeriod / analysisPeriod;
+
+	while(synthesisMark < regionEnd){
+		// Advance the analysis marks until they are closest to the synthesis mark
+		// Grains are repeated when raising the pitch, and skipped when lowering it
+		while(analysisMark + 0.5 * analysisPeriod < synthesisMark - lag && unshifted == false){
+			analysisMark = findPitchMark(input, windowStart, analysisMark + analysisPeriod, analysisPeriod);
+		}
+		if(unshifted){
+			analysisMark = synthesisMark - lag;
+		}
+
+		// Keep the grain inside the window and its history
+		int analysisCentre = fmin(fmax((int)analysisMark, halfLength - history), windowSize - halfLength - 1);
+
+		overlapAddGrain(input, output, windowStart, outputPointer, analysisCentre, (int)synthesisMark, halfLength, gain, firstOutputSample);
+
+		synthesisMark += synthesisPeriod;
+	}
+}
+
+// Find the largest sample near a predicted pitch mark
+float psola::findPitchMark(circularBuffer* input, int windowStart, float predictedMark, int period){
+	int searchRadius = period / 4;
+	int start = fmax((int)predictedMark - searchRadius, -history);
+	int end = fmin((int)predictedMark + searchRadius, windowSize - 1);
+
+	int mark = (int)predictedMark;
+	float largest = -1e9;
+	for(int i = start; i <= end; i++){
+		float sample = input->returnElement(windowStart + i);
+		if(sample > largest){
+			largest = sample;
+			mark = i;
+		}
+	}
+
+	return mark;
+}
+
+// Window a grain centred on analysisCentre and add it to the output centred on synthesisCentre
+void psola::overlapAddGrain(circularBuffer* input, circularBuffer* output, int windowStart, int outputPointer, int analysisCentre, int synthesisCentre, int halfLength, float gain, int firstOutputSample){
+	float windowStep = (float)kGrainWindowSize / (float)(2 * halfLength);
+	int start = fmax(-halfLength, firstOutputSample - synthesisCentre);
+	for(int j = start; j <= halfLength; j++){
+		float w = grainWindow[(int)((j + halfLength) * windowStep)];
+		output->addToElement(outputPointer + synthesisCentre + j, gain * w * input->returnElement(windowStart + analysisCentre + j));
+	}
+}
+
+#endif //PSOLA_H
\ No newline at end of file
@@ -15,49 +15,78 @@
 #include <cmath>
 #include <fstream>
 
-#include "circularBuffer.h"
-#include "fftContainer.h"
-#include "spectrum.h"
 #include "button.h"
-#include "hps.h"
-#include "compareNotes.h"
-#include "phaseVocoder.h"
+#include "correctionChannel.h"
+#include "rtAudit.h"
+#include "telemetry.h"
+#include "hopScheduler.h"
+#include "sessionRecorder.h"
+#include "controlParameters.h"
 
 button *gSpectrumButton; // The button used to export a spectrum. 
 button *gDisableButton;
 button *gScaleButton;
 
-circularBuffer** gInputBuffers; // The circular buffers used for storing input data
-circularBuffer** gOutputBuffers;
+// The input and output buffers, pitch detection and correction engines of each channel
+correctionChannel** gChannels;
 
 #define BUFFER_SIZE 16384// Number of samples to be stored in the buffer - accounting for 2-channel audio
-int gCachedInputBufferPointers[2] = {0}; // Cached input buffer write pointers.
 
 int gHopCounter = 0; 
 int gWindowSize = 4096; // Size of window
 int gHopSize = gWindowSize/4; // How far between hops
+int gLatency; // Samples from a sample coming in to its corrected version going out, set in setup()
 
-int gAudioChannels = 0; // Used to store the number of audio channels to be passed to the auxiliary task
+// Low-latency mode, for performers monitoring themselves through the corrector
+// Correction runs on a short window and hop, while pitch is still detected on a window of the size set in gWindowSize,
+// ending at the same sample, every gLowLatencyAnalysisInterval hops. The through-latency is the short window plus a hop
+// The short window limits the fundamentals the phase vocoder can correct: at 44.1kHz it needs harmonics 3.5 bins apart
+// (about 300Hz and up at 512 samples). A single voice below that is corrected by PSOLA, whose grains are cut from the
+// detection window when they don't fit in the short one, and are heard a little later the lower the voice (see README)
+// With more voices, lower fundamentals are passed through unshifted rather than shifted inharmonically, and counted in cleanup()
+bool gLowLatency = false;
+int gLowLatencyWindowSize = 512;
+int gLowLatencyHopSize = 128;
+int gLowLatencyAnalysisInterval = 4;
 
-float* gHanningWindow; // The Hanning window
+// The pitch detection window, when it differs from gWindowSize. 0 uses gWindowSize. Set by the low-latency mode
+int gDetectionWindowSize = 0;
+int gAnalysisInterval = 1; // Hops between pitch detections. The hops in between reuse the last pitch
+int gHopsUntilAnalysis = 0;
 
-// Temporary storage for storing the unprocessed frequency domain when exporting a spectrum
-ne10_fft_cpx_float32_t* oldFrequencyDomain;
+int gAudioChannels = 0; // Used to store the number of audio channels to be passed to the auxiliary task
 
 // Thread for FFT processing
 AuxiliaryTask gFFTTask;
 
-// FFT containers, defined in fftContainer.h
-FFTContainer** gFFTs;
+// Polyphonic correction, for backing vocals or doubled parts on one channel
+// Up to gVoices fundamentals are found in each hop by harmonic subtraction, and each voice's harmonics are shifted to
+// its own nearest note in the same spectrum. Only used by the phase vocoder. With 1 a single voice is corrected
+int gVoices = 1;
+
+// Decimated analysis path
+// When enabled, pitch is detected on a low-passed and decimated copy of the input using a window gDecimationFactor times shorter
+// The frequency resolution is unchanged, so the peak bin found can be used directly by the full-band phase vocoder
+// Fundamentals are limited to around 1.8kHz at 44.1kHz with a factor of 4 - see tools/decimationBenchmark.cpp for accuracy
+// This also makes the analysis hops of the low-latency mode cheaper
+// The anti-aliasing filter delays the analysis window by 31 samples relative to the correction window (see decimator.h)
+bool gDecimatedAnalysis = false;
+int gDecimationFactor = 4;
 
-// Harmonic product spectrums for finding fundamental frequency
-HPS** gHPSs;
+// Formant preservation for the phase vocoder, so that large corrections don't move the formants with the pitch
+// A cepstral envelope is estimated from the amplitude spectrum the HPS has already calculated, using one 256 point FFT,
+// and each shifted bin is scaled by the envelope at its destination over the envelope at its source
+// Its cost is reported as the envelope stage in the telemetry summary
+bool gFormantPreservation = false;
 
-// The fundamental frequency for each channel
-float gFundamentalFrequencies[2] = {0};
+// Correction engine used by each channel (see correctionChannel.h). Channels beyond the end of this list use the phase vocoder
+int gChannelEngines[] = {ENGINE_PHASE_VOCODER, ENGINE_PHASE_VOCODER};
 
-// The phase vocoder used to shift the frequency peak
-phaseVocoder** gPhaseVocoders;
+// Fixed-point processing mode, for cores with slow floating point
+// Only the pitch detection path is fixed point: windowing, the full-band FFT and IFFT, magnitudes and the HPS product
+// run in Q31 with block floating point scaling. The phase vocoder and PSOLA work in float, so the spectrum is converted
+// to float and back each hop. tools/fixedPointReport.cpp measures the accuracy and the time per hop against the float path
+bool gFixedPointProcessing = false;
 
 enum{ // Available scales for note comparisons
 	PENTATONIC = 0,
@@ -66,13 +95,49 @@ enum{ // Available scales for note comparisons
 };
 
 int gScale = PENTATONIC; // Which scale should be used?
+const char* gScaleNames[] = {"PENTATONIC", "C_MAJOR", "C_MINOR"};
 
 int gScaleTimer = 0; // How long has it been since the scale has been changed?
 
+// Live controls. render() owns gScale, gKey, gCorrectionStrength, gChannelEngines and the button states, and
+// publishes them through gControlBlock when they change. The processing thread takes the latest set at the start
+// of each hop, so a hop never sees a change halfway through. Correction strength is smoothed over a few hops
+int gKey = 0; // Semitones above C
+float gCorrectionStrength = 1.0; // Share of the correction applied, from 0 to 1
+controlBlock* gControlBlock;
+controlParameters gHopControls; // The controls for the current hop. Processing thread only
+float gHopStrength = 1.0; // Smoothed correction strength. Processing thread only
+
+// Telemetry from the processing thread, replacing per-hop console printing
+// A summary of each channel is printed every gTelemetrySummaryInterval seconds
+// Set a file or socket path to receive every gTelemetryDecimation-th record in binary - see telemetry.h for the layout
+telemetry* gTelemetry;
+float gTelemetrySummaryInterval = 1.0;
+const char* gTelemetryFilePath = nullptr;
+const char* gTelemetrySocketPath = nullptr;
+int gTelemetryDecimation = 1;
+
+// Hops are passed to the processing thread through a queue, each with a deadline
+// A hop's output starts to be played a hop after its window ends, so processing has one hop of margin
+// gLateHopPolicy chooses what happens to hops which start after their deadline - see hopScheduler.h
+hopScheduler* gHopScheduler;
+int gLateHopPolicy = LATE_HOP_PROCESS;
+
+// Session recording, for reproducing problems offline with tools/sessionReplay.cpp
+// Set a path to record the configuration, input, button states, control changes and hop timing of the whole session
+const char* gSessionRecordPath = nullptr;
+sessionRecorder* gSessionRecorder = nullptr;
+
 // Predeclaration
-void processAudio(void* arg);
+void processAudio(void*);
+int processScheduledHop(hopRequest& hop);
+void processHop(hopRequest& hop, int firstSample);
+void applyControls();
+void publishControls();
+int channelEngine(int channel);
+sessionControls currentSessionControls();
 
-bool setup(BelaContext *context, void *userData)
+bool setup(BelaContext *context, void *)
 {
 	
 	// Ensure ne10 loaded properly
@@ -87,37 +152,108 @@ bool setup(BelaContext *context, void *userData)
 	
 	gAudioChannels = context->audioInChannels; // Required to pass value to secondary thread
 	
-	// Create circular buffers for input/output storage - one per audio channel
-	gInputBuffers = (circularBuffer**) malloc (context->audioInChannels * sizeof(circularBuffer*));
-	gOutputBuffers = (circularBuffer**) malloc (context->audioInChannels * sizeof(circularBuffer*));
-	
-	// We need one FFT per audio channel
-	gFFTs = (FFTContainer**)malloc(context->audioInChannels * sizeof(FFTContainer*));
+	// Correct on the short window, and keep the configured window for pitch detection
+	if(gLowLatency){
+		gDetectionWindowSize = gWindowSize;
+		gWindowSize = gLowLatencyWindowSize;
+		gHopSize = gLowLatencyHopSize;
+		gAnalysisInterval = gLowLatencyAnalysisInterval;
+	}
+	if(gDetectionWindowSize == 0){
+		gDetectionWindowSize = gWindowSize;
+	}
+	if(gAnalysisInterval < 1){
+		gAnalysisInterval = 1;
+	}
+	gHopsUntilAnalysis = 0;
 	
-	// Harmonic product spectra for finding the fundamental frequency (pitch) of the incoming signal, one per channel
-	gHPSs = (HPS**)malloc(context->audioInChannels * sizeof(HPS*));
+	// The input window ends a hop before its output starts, so a sample takes a window and a hop to come out
+	gLatency = gWindowSize + gHopSize;
+	rt_printf("Latency %d samples (%.1fms): %d point window, %d sample hop.\n", gLatency,
+		1000.0 * gLatency / context->audioSampleRate, gWindowSize, gHopSize);
 	
-	// Phase vocoders for shifting the frequency peaks
-	gPhaseVocoders = (phaseVocoder**)malloc(context->audioInChannels * sizeof(phaseVocoder*));
+	// Every channel is built the same way. The engine is set per channel, and can be changed while running
+	correctionConfig config;
+	config.windowSize = gWindowSize;
+	config.hopSize = gHopSize;
+	config.sampleRate = context->audioSampleRate;
+	config.detectionWindowSize = gDetectionWindowSize;
+	config.bufferSize = BUFFER_SIZE;
+	config.decimatedAnalysis = gDecimatedAnalysis;
+	config.decimationFactor = gDecimationFactor;
+	config.fixedPoint = gFixedPointProcessing;
+	config.formantPreservation = gFormantPreservation;
+	config.voices = gVoices;
 	
 	// Allocate memory per audio channel
-	for(int channel = 0; channel < context->audioInChannels; channel++){
-		gInputBuffers[channel] = new circularBuffer(BUFFER_SIZE);
-		gOutputBuffers[channel] = new circularBuffer(BUFFER_SIZE);
-		gOutputBuffers[channel]->setWritePointer(gHopSize);
-		gFFTs[channel] = new FFTContainer(gWindowSize, context->audioSampleRate);
-		gHPSs[channel] = new HPS(gWindowSize, context->audioSampleRate);
-		gPhaseVocoders[channel] = new phaseVocoder(gWindowSize, gHopSize, context->audioSampleRate);
+	gChannels = (correctionChannel**) malloc (gAudioChannels * sizeof(correctionChannel*));
+	for(int channel = 0; channel < gAudioChannels; channel++){
+		
+		// Choose the correction engine for this channel
+		config.engine = channelEngine(channel);
+		gChannels[channel] = new correctionChannel(config);
+		if(config.engine == ENGINE_PSOLA){
+			rt_printf("Channel %d using PSOLA.\n", channel);
+		}
+	}
+	
+	if(gVoices > 1){
+		rt_printf("Polyphonic correction of up to %d voices.\n", gVoices);
+	}
+	if(gFormantPreservation){
+		rt_printf("Formant preservation enabled.\n");
+	}
+	if(gFixedPointProcessing){
+		rt_printf("Fixed-point processing enabled.\n");
+	}
+	if(gDecimatedAnalysis || gDetectionWindowSize != gWindowSize){
+		rt_printf("%s analysis enabled: %d point pitch detection.\n", gDecimatedAnalysis ? "Decimated" : "Separate",
+			gAudioChannels > 0 ? gChannels[0]->returnAnalysisWindowSize() : 0);
+	}
+	
+	// Say how low each channel can correct on the low-latency window
+	if(gLowLatency){
+		for(int channel = 0; channel < gAudioChannels; channel++){
+			rt_printf("Channel %d corrects fundamentals above %.0fHz.\n", channel, gChannels[channel]->returnMinimumFrequency());
+		}
+	}
+	if(gAnalysisInterval > 1){
+		rt_printf("Pitch detected every %d hops.\n", gAnalysisInterval);
+	}
+	rt_printf("%d shared FFT plans and windows.\n", fftPlanCache::returnTableCount());
+	
+	// Start the telemetry consumer
+	gTelemetry = new telemetry(context->audioInChannels);
+	gTelemetry->setSummaryInterval(gTelemetrySummaryInterval);
+	gTelemetry->setScaleNames(gScaleNames, 3);
+	gTelemetry->setDecimation(gTelemetryDecimation);
+	if(gTelemetryFilePath){
+		gTelemetry->writeToFile(gTelemetryFilePath);
+	}
+	if(gTelemetrySocketPath){
+		gTelemetry->sendToSocket(gTelemetrySocketPath);
 	}
+	gTelemetry->start();
+	
+	gHopScheduler = new hopScheduler(gHopSize, gWindowSize, context->audioFrames);
 	
-	// Temporary storage for storing the unprocessed frequency domain when exporting a spectrum
-	// Otherwise it is overwritten by the phase vocoder before it finishes writing to the file
-	oldFrequencyDomain = (ne10_fft_cpx_float32_t*) malloc (gWindowSize * sizeof(ne10_fft_cpx_float32_t));
+	// Controls start as they were set at compile time
+	controlParameters controls = {};
+	controls.scale = gScale;
+	controls.key = gKey;
+	controls.strength = gCorrectionStrength;
+	for(int channel = 0; channel < gAudioChannels && channel < CONTROL_MAX_CHANNELS; channel++){
+		controls.engines[channel] = gChannels[channel]->returnEngine();
+	}
+	gControlBlock = new controlBlock(controls);
+	gHopControls = controls;
+	gHopStrength = gCorrectionStrength;
 	
-	// Prepopulate Hanning window array for efficiency
-	gHanningWindow = (float*) malloc (gWindowSize * sizeof(float));
-	for(int i = 0; i < gWindowSize; i++){
-		gHanningWindow[i] = 0.5-(0.5*cos((2*M_PI*(float)i)/((float)gWindowSize-1.0)));
+	if(gSessionRecordPath){
+		gSessionRecorder = new sessionRecorder(context, config, gAnalysisInterval, gLateHopPolicy, currentSessionControls());
+		if(gSessionRecorder->start(gSessionRecordPath)){
+			rt_printf("Recording session to %s\n", gSessionRecordPath);
+		}
 	}
 	
 	// Set up auxiliary task
@@ -129,100 +265,159 @@ bool setup(BelaContext *context, void *userData)
 }
 
 // Process the audio. This is handled by an auxiliary thread
-void processAudio(void *arg){
+void processAudio(void *){
+	
+	// Debug builds can catch anything in here that isn't real-time safe
+	rtAuditMarkRealtimeThread("bela-process-fft");
+	
+	// Work through every waiting hop, oldest first
+	hopRequest hop;
+	while(gHopScheduler->next(hop)){
+		processScheduledHop(hop);
+	}
+}
 
-	// For each channel
-	for(int channel = 0; channel < gAudioChannels; channel++){
-		
-		// Shift read pointer starting position to gWindowSize samples behind the last input
-		gInputBuffers[channel]->setReadPointer(gCachedInputBufferPointers[channel] - gWindowSize);
-		
-		// Load inputs into timerDomain
-		for(int i = 0; i < gWindowSize; i++){
-			gFFTs[channel]->timeDomainIn[i].r = (ne10_float32_t)gInputBuffers[channel]->returnNextElement() * gHanningWindow[i];
-			gFFTs[channel]->timeDomainIn[i].i = 0;
+// Process, bypass or skip one hop taken from the queue, depending on how late it is
+// tools/sessionReplay.cpp calls this directly to replay each hop at the frame it was processed at live
+int processScheduledHop(hopRequest& hop){
+	rtAuditBeginHop();
+	
+	applyControls();
+	
+	int lateFrames = gHopScheduler->lateness(hop);
+	int outcome = gHopScheduler->decide(lateFrames, gLateHopPolicy);
+	
+	if(gSessionRecorder){
+		gSessionRecorder->recordHop(hop.sequence, gHopScheduler->returnCurrentFrame(), lateFrames);
+	}
+	
+	// The first sample of the hop's output which hasn't been played yet
+	int firstSample = (lateFrames > 0) ? lateFrames : 0;
+	
+	if(outcome == HOP_ON_TIME || outcome == HOP_PROCESSED_LATE){
+		processHop(hop, firstSample);
+	}
+	else if(outcome == HOP_BYPASSED){
+		for(int channel = 0; channel < gAudioChannels; channel++){
+			gChannels[channel]->bypassHop(hop.inputPointer, firstSample, true);
+		}
+	}
+	else if(outcome == HOP_DROPPED){
+		// The windows of the neighbouring hops crossfade across the gap on phase vocoder channels
+		// PSOLA's synthesis regions don't overlap, so its channels are passed through instead of leaving a hole
+		for(int channel = 0; channel < gAudioChannels; channel++){
+			gChannels[channel]->bypassHop(hop.inputPointer, firstSample, false);
 		}
 	}
+	// Expired hops write nothing, as all of their output has already been played
 	
-	for(int channel = 0; channel < gAudioChannels; channel++){
-				
-		// Calculate FFT
-		ne10_fft_c2c_1d_float32_neon(gFFTs[channel]->frequencyDomain, gFFTs[channel]->timeDomainIn, gFFTs[channel]->cfg, 0);
-		
-				
-		// ---- Frequency domain processing ---- //
-		
+	gHopScheduler->count(outcome);
+	
+	telemetryRecord record = {};
+	record.timestamp = telemetry::now();
+	record.type = TELEMETRY_HOP;
+	record.sequence = hop.sequence;
+	record.lateFrames = lateFrames;
+	record.outcome = outcome;
+	gTelemetry->pushRecord(record);
+	
+	rtAuditEndHop();
+	
+	return outcome;
+}
+
+// Take the latest controls from render(). Called at the start of each hop on the processing thread
+void applyControls(){
+	if(gControlBlock->read(gHopControls)){
 		
-		if(gDisableButton->isPressed() == false){ // Disable processing if button 2 is pressed
-			
-			// Output a .txt frequency spectrum when the button is pressed (low) 
-			// Will overwrite files with the same name
-			// Can cause problems to the audio when used
-			if(gSpectrumButton->isPressed() && channel == 0){
-				
-				// Store frequencyDomain so that it isn't overwritten before output is complete
-				for(int i = 0; i < gWindowSize; i++){
-					oldFrequencyDomain[i].r = gFFTs[0]->frequencyDomain[i].r;
-					oldFrequencyDomain[i].i = gFFTs[0]->frequencyDomain[i].i;
-				}
-				generateFrequencySpectrum(oldFrequencyDomain, gFFTs[0]->sampleRate, gFFTs[0]->size, "frequency_spectrumOld.txt");
-			}
-			
-			// Use harmonic product spectrum to find the fundamental frequency of the incoming sound
-			gHPSs[channel]->importSpectrum(gFFTs[channel]->frequencyDomain);
-			gHPSs[channel]->calculate();
-			int peakBin = gHPSs[channel]->returnPeakLocation();
-			float fundamentalFrequency = gHPSs[channel]->estimateFundamentalFrequency(peakBin);
-			
-			// Only update gFundamentalFrequencies if the output is valid
-			if(fundamentalFrequency != 0){
-				gFundamentalFrequencies[channel] = fundamentalFrequency;
-				//rt_printf("%f\n", gFundamentalFrequencies[channel]); // For monitoring
-			}
-			
-			// Find the note that's closest to the fundamental frequency
-			float desiredNote = compareNotes(gScale, gFundamentalFrequencies[channel]);
-			if(fundamentalFrequency != 0){
-				rt_printf("Fundamental frequency:%f Desired note:%f\n", gFundamentalFrequencies[channel], desiredNote); // For monitoring
-			}
-			
-			// Output a .txt file conatining the HPS when the button is pressed (low)
-			// Will overwrite files with the same name
-			// Can cause problems to the audio when used
-			if(gSpectrumButton->isPressed() && channel == 0){
-				gHPSs[0]->exportHPS("HPSBefore.txt");
-			}
-			
-			// Shift the peak towards the desired note
-			gPhaseVocoders[channel]->shiftFrequency(gFFTs[channel]->frequencyDomain, peakBin, gFundamentalFrequencies[channel], desiredNote);
-			
-			// Output a .txt frequency spectrum when the button is pressed (low) 
-			// Will overwrite files with the same name
-			// Can cause problems to the audio when used
-			if(gSpectrumButton->isPressed()  && channel == 0){
-				generateFrequencySpectrum(gFFTs[0]->frequencyDomain, gFFTs[0]->sampleRate, gFFTs[0]->size, "frequency_spectrum.txt");
-			}
+		// A new engine starts from the input, as its state from before it was last used is stale
+		for(int channel = 0; channel < gAudioChannels && channel < CONTROL_MAX_CHANNELS; channel++){
+			gChannels[channel]->setEngine(gHopControls.engines[channel]);
 		}
-		
-		// Calculate inverse FFT to bring the processed audio back to the time domain
-		ne10_fft_c2c_1d_float32_neon(gFFTs[channel]->timeDomainOut, gFFTs[channel]->frequencyDomain, gFFTs[channel]->cfg, 1);
 	}
+	gHopStrength = smoothParameter(gHopStrength, gHopControls.strength, 0.5);
+}
+
+// Process one hop of every channel
+void processHop(hopRequest& hop, int firstSample){
+	
+	// Detect pitch on this hop, or keep the last detection
+	bool analyse = (gHopsUntilAnalysis <= 0);
+	gHopsUntilAnalysis = analyse ? gAnalysisInterval - 1 : gHopsUntilAnalysis - 1;
+	
+	correctionControls controls;
+	controls.scale = gHopControls.scale;
+	controls.key = gHopControls.key;
+	controls.strength = gHopStrength;
+	controls.disabled = gHopControls.disabled;
 	
 	for(int channel = 0; channel < gAudioChannels; channel++){
+		telemetryRecord record = {};
+		record.timestamp = telemetry::now();
+		record.type = TELEMETRY_PITCH;
+		record.sequence = hop.sequence;
+		record.channel = channel;
+		record.scale = gHopControls.scale;
 		
-		// Add timeDomainOut into the output buffer. Add to any existing values to account for hop overlap
-		for(int n = 0; n < gWindowSize; n++) {
-			gOutputBuffers[channel]->insertAndAdd(gFFTs[channel]->timeDomainOut[n].r);
-		}
-		// CircularBuffer automatically iterates the write pointer every time an element is added
-		// So we need to pull it back by (gWindowSize-gHopSize) elements to ensure correct hop size
-		gOutputBuffers[channel]->setWritePointer(gOutputBuffers[channel]->returnWritePointer() - (gWindowSize - gHopSize)); 
+		// Only the first channel's spectrum is exported
+		controls.exportSpectrum = (gHopControls.exportSpectrum && channel == 0);
+		gChannels[channel]->processHop(hop.inputPointer, hop.decimatedPointer, firstSample, analyse, controls, record);
+		gTelemetry->pushRecord(record);
+	}
+}
+
+// Publish the controls for the processing thread if any have changed. Called from render()
+void publishControls(){
+	controlParameters& controls = gControlBlock->edit();
+	bool changed = (controls.scale != gScale || controls.key != gKey || controls.strength != gCorrectionStrength
+		|| controls.disabled != gDisableButton->isPressed() || controls.exportSpectrum != gSpectrumButton->isPressed());
+	
+	for(int channel = 0; channel < gAudioChannels && channel < CONTROL_MAX_CHANNELS; channel++){
+		int engine = channelEngine(channel);
+		changed = changed || (controls.engines[channel] != engine);
+		controls.engines[channel] = engine;
 	}
 	
+	if(changed){
+		controls.scale = gScale;
+		controls.key = gKey;
+		controls.strength = gCorrectionStrength;
+		controls.disabled = gDisableButton->isPressed();
+		controls.exportSpectrum = gSpectrumButton->isPressed();
+		gControlBlock->publish();
+	}
+}
+
+// Correction engine of a channel. Channels beyond the end of gChannelEngines use the phase vocoder
+int channelEngine(int channel){
+	int engineCount = sizeof(gChannelEngines) / sizeof(gChannelEngines[0]);
+	return (channel < engineCount) ? gChannelEngines[channel] : ENGINE_PHASE_VOCODER;
+}
+
+// The controls publishControls() takes from outside render(), for the session recording
+sessionControls currentSessionControls(){
+	sessionControls controls = {};
+	controls.scale = gScale;
+	controls.key = gKey;
+	controls.strength = gCorrectionStrength;
+	for(int channel = 0; channel < gAudioChannels && channel < CONTROL_MAX_CHANNELS; channel++){
+		controls.engines[channel] = channelEngine(channel);
+	}
+	return controls;
 }
 
-void render(BelaContext *context, void *userData)
+void render(BelaContext *context, void *)
 {	
+	rtAuditMarkRealtimeThread("render");
+	rtAuditBeginHop();
+	
+	gHopScheduler->setCurrentFrame(context->audioFramesElapsed);
+	
+	if(gSessionRecorder){
+		gSessionRecorder->recordBlock(context);
+		gSessionRecorder->recordControls(context, currentSessionControls());
+	}
+	
 	// Update button states
 	gSpectrumButton->updateState(context);
 	gDisableButton->updateState(context);
@@ -232,39 +427,42 @@ void render(BelaContext *context, void *userData)
 	if(gScaleButton->isPressed() && gScaleTimer > 2000){
 		if(gScale == C_MINOR){
 			gScale = PENTATONIC;
-			rt_printf("PENTATONIC\n");
 		}
 		else if(gScale == C_MAJOR){
 			gScale = C_MINOR;
-			rt_printf("C_MINOR\n");
 		}
 		else if(gScale == PENTATONIC){
 			gScale = C_MAJOR;
-			rt_printf("C_MAJOR\n");
 		}
 		gScaleTimer = 0;
+		
+		// The telemetry thread prints the new scale
+		telemetryRecord record = {};
+		record.timestamp = telemetry::now();
+		record.type = TELEMETRY_SCALE_CHANGE;
+		record.scale = gScale;
+		gTelemetry->pushControlRecord(record);
 	}
 	if(gScaleTimer < 2001){
 		gScaleTimer++;
 	}
 	
+	publishControls();
+	
 	// For each audio frame
 	for(unsigned int n = 0; n < context->audioFrames; n++){
 		
 		// For each audio channel
-		for(int channel = 0; channel < context->audioInChannels; channel++){
-			
-			// Read samples from audio input header
-			float in = audioRead(context, n, channel);
+		for(int channel = 0; channel < gAudioChannels; channel++){
 			
-			// and store them in circular buffers - one per channel
-			gInputBuffers[channel]->insert(in);
+			// Read samples from audio input header, and store them in the channel's input buffer
+			gChannels[channel]->insert(audioRead(context, n, channel));
 		}
 		
-		for(int channel = 0; channel < context->audioInChannels; channel++){
+		for(int channel = 0; channel < gAudioChannels; channel++){
 			
 			// Read the next values from the output buffers
-			float out = gOutputBuffers[channel]->returnAndEmptyNextElement();
+			float out = gChannels[channel]->returnAndEmptyNextElement();
 			
 			// And write them to the output
 			audioWrite(context, n, channel, out);
@@ -274,10 +472,8 @@ void render(BelaContext *context, void *userData)
 		// Only process FFT after gHopSize samples
 		if(gHopCounter >= gHopSize){
 			
-			// Cache input buffer write pointers for auxiliary thread
-			for(int channel = 0; channel < context->audioInChannels; channel++){
-				gCachedInputBufferPointers[channel] = gInputBuffers[channel]->returnWritePointer();
-			}
+			// Queue the hop for the auxiliary thread. All channels share the same buffer positions
+			gHopScheduler->schedule(gChannels[0]->returnInputPointer(), gChannels[0]->returnDecimatedPointer(), context->audioFramesElapsed + n);
 			Bela_scheduleAuxiliaryTask(gFFTTask); // Process audio on auxiliary thread
 			
 			gHopCounter = 0; // Reset hop counter
@@ -285,25 +481,45 @@ void render(BelaContext *context, void *userData)
 		
 	}
 	
+	rtAuditEndHop();
 }
 
-void cleanup(BelaContext *context, void *userData)
+void cleanup(BelaContext *, void *)
 {
-	for(int channel = 0; channel < context->audioInChannels; channel++){
-		delete gPhaseVocoders[channel];
-		delete gHPSs[channel];
-		delete gFFTs[channel];
-		delete gInputBuffers[channel];
-		delete gOutputBuffers[channel];
-	}
-	free(gPhaseVocoders);
-	free(gHPSs);
-	free(gFFTs);
-	free(gInputBuffers);
-	free(gOutputBuffers);
-	free(gHanningWindow);
-	free(oldFrequencyDomain);
+	delete gTelemetry;
+	
+	// Report any hops which weren't processed on time
+	for(int i = HOP_ON_TIME; i < HOP_OUTCOMES; i++){
+		rt_printf("%u hops %s\n", gHopScheduler->returnCount(i), kHopOutcomeNames[i]);
+	}
+	int hopsBelowRange = 0;
+	for(int channel = 0; channel < gAudioChannels; channel++){
+		hopsBelowRange += gChannels[channel]->returnHopsBelowRange();
+	}
+	if(hopsBelowRange > 0){
+		rt_printf("%d hops below the lowest fundamental a %d point window can correct, passed through unshifted\n", hopsBelowRange, gWindowSize);
+	}
+	delete gHopScheduler;
+	delete gControlBlock;
+	
+	if(gSessionRecorder){
+		delete gSessionRecorder;
+	}
+	
+	for(int channel = 0; channel < gAudioChannels; channel++){
+		delete gChannels[channel];
+	}
+	free(gChannels);
+	if(gDecimatedAnalysis){
+		rt_printf("Decimators deleted.\n");
+	}
 	
 	delete gDisableButton;
 	delete gSpectrumButton;
+	
+	// Fail the run if the real-time safety audit caught anything. Always passes unless built with RT_SAFETY_AUDIT
+	if(rtAuditReport() > 0){
+		rt_printf("Real-time safety audit failed.\n");
+		exit(EXIT_FAILURE);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,313 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef RTAUDIT_H
+#define RTAUDIT_H
+
+// Real-time safety audit
+// Build with -DRT_SAFETY_AUDIT to intercept memory allocation, file I/O and mutex locking
+// Any of these during a hop (or render callback) on a thread marked as real-time is recorded along with its call stack
+// and counted per hop. Between hops the thread is left alone, so the offline tools can read and write files there
+// rtAuditReport() prints what was found and returns the number of violations, so an offline run can fail on it
+// Interposition relies on glibc (__libc_malloc and dlsym(RTLD_NEXT)), so link with -ldl
+// Without RT_SAFETY_AUDIT every function here is an empty inline and costs nothing
+
+#ifdef RT_SAFETY_AUDIT
+
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+extern "C" void __libc_free(void* pointer);
+
+#define RT_AUDIT_MAX_SITES 64 // Distinct call sites recorded
+#define RT_AUDIT_STACK_DEPTH 6 // Frames recorded per call site
+
+enum{ // Types of operation which aren't real-time safe
+	RT_AUDIT_ALLOCATION = 0,
+	RT_AUDIT_FILE_IO,
+	RT_AUDIT_LOCK
+};
+
+const char* kRtAuditKinds[] = {"allocation", "file I/O", "lock"};
+
+// A call site which has performed an unsafe operation
+struct rtAuditSite{
+	std::atomic<int> state; // 0 = free, 1 = being filled, 2 = ready
+	int kind;
+	const char* function; // The intercepted function
+	const char* threadName;
+	void* stack[RT_AUDIT_STACK_DEPTH];
+	int depth;
+	std::atomic<unsigned int> count;
+};
+
+rtAuditSite gRtAuditSites[RT_AUDIT_MAX_SITES];
+std::atomic<unsigned int> gRtAuditViolations(0);
+std::atomic<unsigned int> gRtAuditUnrecordedViolations(0); // Violations from sites after the table filled
+std::atomic<unsigned int> gRtAuditHops(0);
+std::atomic<unsigned int> gRtAuditFailedHops(0); // Hops with at least one violation
+std::atomic<unsigned int> gRtAuditWorstHop(0); // Most violations in a single hop
+
+thread_local const char* tRtAuditThreadName = nullptr; // Set on real-time threads
+thread_local bool tRtAuditInsideHook = false; // Prevents the audit recording itself
+thread_local bool tRtAuditInHop = false; // Between rtAuditBeginHop() and rtAuditEndHop()
+thread_local unsigned int tRtAuditHopViolations = 0;
+
+// The real versions of the intercepted functions
+FILE* (*gRealFopen)(const char*, const char*);
+FILE* (*gRealFopen64)(const char*, const char*);
+int (*gRealFclose)(FILE*);
+size_t (*gRealFread)(void*, size_t, size_t, FILE*);
+size_t (*gRealFwrite)(const void*, size_t, size_t, FILE*);
+int (*gRealFflush)(FILE*);
+int (*gRealOpen)(const char*, int, ...);
+int (*gRealClose)(int);
+ssize_t (*gRealRead)(int, void*, size_t);
+ssize_t (*gRealWrite)(int, const void*, size_t);
+int (*gRealMutexLock)(pthread_mutex_t*);
+int (*gRealMutexTrylock)(pthread_mutex_t*);
+
+// Look up the real functions before main() runs
+__attribute__((constructor)) void rtAuditResolve(){
+	gRealFopen = (FILE* (*)(const char*, const char*))dlsym(RTLD_NEXT, "fopen");
+	gRealFopen64 = (FILE* (*)(const char*, const char*))dlsym(RTLD_NEXT, "fopen64");
+	gRealFclose = (int (*)(FILE*))dlsym(RTLD_NEXT, "fclose");
+	gRealFread = (size_t (*)(void*, size_t, size_t, FILE*))dlsym(RTLD_NEXT, "fread");
+	gRealFwrite = (size_t (*)(const void*, size_t, size_t, FILE*))dlsym(RTLD_NEXT, "fwrite");
+	gRealFflush = (int (*)(FILE*))dlsym(RTLD_NEXT, "fflush");
+	gRealOpen = (int (*)(const char*, int, ...))dlsym(RTLD_NEXT, "open");
+	gRealClose = (int (*)(int))dlsym(RTLD_NEXT, "close");
+	gRealRead = (ssize_t (*)(int, void*, size_t))dlsym(RTLD_NEXT, "read");
+	gRealWrite = (ssize_t (*)(int, const void*, size_t))dlsym(RTLD_NEXT, "write");
+	gRealMutexLock = (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_lock");
+	gRealMutexTrylock = (int (*)(pthread_mutex_t*))dlsym(RTLD_NEXT, "pthread_mutex_trylock");
+}
+
+// Mark the calling thread as real-time. Cheap enough to call at the start of every callback
+inline void rtAuditMarkRealtimeThread(const char* name){
+	if(tRtAuditThreadName == nullptr){
+		// The first backtrace() loads the unwinder, which allocates, so do it before the thread is marked
+		void* warmUp[2];
+		backtrace(warmUp, 2);
+		tRtAuditThreadName = name;
+	}
+}
+
+// Record an unsafe operation if the calling thread is real-time
+void rtAuditRecord(int kind, const char* function){
+	if(tRtAuditThreadName == nullptr || tRtAuditInHop == false || tRtAuditInsideHook){
+		return;
+	}
+	tRtAuditInsideHook = true;
+
+	gRtAuditViolations++;
+	tRtAuditHopViolations++;
+
+	// Skip this function and the hook itself
+	void* stack[RT_AUDIT_STACK_DEPTH + 2];
+	int depth = backtrace(stack, RT_AUDIT_STACK_DEPTH + 2) - 2;
+	if(depth < 0){
+		depth = 0;
+	}
+
+	// Find the matching call site, or claim a free one
+	bool recorded = false;
+	for(int i = 0; i < RT_AUDIT_MAX_SITES && !recorded; i++){
+		rtAuditSite& site = gRtAuditSites[i];
+		int state = site.state.load();
+		if(state == 2){
+			if(site.kind == kind && site.depth == depth && memcmp(site.stack, stack + 2, depth * sizeof(void*)) == 0){
+				site.count++;
+				recorded = true;
+			}
+		}
+		else if(state == 0){
+			int expected = 0;
+			if(site.state.compare_exchange_strong(expected, 1)){
+				site.kind = kind;
+				site.function = function;
+				site.threadName = tRtAuditThreadName;
+				site.depth = depth;
+				memcpy(site.stack, stack + 2, depth * sizeof(void*));
+				site.count = 1;
+				site.state = 2;
+				recorded = true;
+			}
+		}
+	}
+	if(!recorded){
+		gRtAuditUnrecordedViolations++;
+	}
+
+	tRtAuditInsideHook = false;
+}
+
+// Call at the start and end of each hop (or render callback) on a real-time thread
+inline void rtAuditBeginHop(){
+	tRtAuditHopViolations = 0;
+	tRtAuditInHop = true;
+}
+
+inline void rtAuditEndHop(){
+	tRtAuditInHop = false;
+	gRtAuditHops++;
+	if(tRtAuditHopViolations > 0){
+		gRtAuditFailedHops++;
+		unsigned int worst = gRtAuditWorstHop.load();
+		while(tRtAuditHopViolations > worst && !gRtAuditWorstHop.compare_exchange_weak(worst, tRtAuditHopViolations)){
+		}
+	}
+}
+
+// Print the audit results and return the number of violations
+// Writes straight to stderr with the real write(), so this is safe to call at any time after the audio has stopped
+unsigned int rtAuditReport(){
+	unsigned int violations = gRtAuditViolations.load();
+	unsigned int hops = gRtAuditHops.load();
+	char line[256];
+
+	int length = snprintf(line, sizeof(line), "Real-time safety audit: %u violations in %u of %u hops (worst hop %u)\n",
+		violations, gRtAuditFailedHops.load(), hops, gRtAuditWorstHop.load());
+	gRealWrite(STDERR_FILENO, line, length);
+
+	for(int i = 0; i < RT_AUDIT_MAX_SITES; i++){
+		rtAuditSite& site = gRtAuditSites[i];
+		if(site.state.load() != 2){
+			continue;
+		}
+		length = snprintf(line, sizeof(line), "  %s in %s on thread %s: %u times (%.2f per hop)\n",
+			kRtAuditKinds[site.kind], site.function, site.threadName, site.count.load(),
+			hops > 0 ? (float)site.count.load() / (float)hops : 0.0f);
+		gRealWrite(STDERR_FILENO, line, length);
+		backtrace_symbols_fd(site.stack, site.depth, STDERR_FILENO);
+	}
+
+	if(gRtAuditUnrecordedViolations.load() > 0){
+		length = snprintf(line, sizeof(line), "  %u further violations from unrecorded call sites\n", gRtAuditUnrecordedViolations.load());
+		gRealWrite(STDERR_FILENO, line, length);
+	}
+
+	return violations;
+}
+
+// ---- Interposed functions ---- //
+
+extern "C" {
+
+void* malloc(size_t size){
+	rtAuditRecord(RT_AUDIT_ALLOCATION, "malloc");
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size){
+	rtAuditRecord(RT_AUDIT_ALLOCATION, "calloc");
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size){
+	rtAuditRecord(RT_AUDIT_ALLOCATION, "realloc");
+	return __libc_realloc(pointer, size);
+}
+
+void free(void* pointer){
+	if(pointer){
+		rtAuditRecord(RT_AUDIT_ALLOCATION, "free");
+	}
+	__libc_free(pointer);
+}
+
+FILE* fopen(const char* path, const char* mode){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "fopen");
+	return gRealFopen(path, mode);
+}
+
+FILE* fopen64(const char* path, const char* mode){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "fopen64");
+	return gRealFopen64(path, mode);
+}
+
+int fclose(FILE* stream){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "fclose");
+	return gRealFclose(stream);
+}
+
+size_t fread(void* data, size_t size, size_t count, FILE* stream){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "fread");
+	return gRealFread(data, size, count, stream);
+}
+
+size_t fwrite(const void* data, size_t size, size_t count, FILE* stream){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "fwrite");
+	return gRealFwrite(data, size, count, stream);
+}
+
+int fflush(FILE* stream){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "fflush");
+	return gRealFflush(stream);
+}
+
+int open(const char* path, int flags, ...){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "open");
+	mode_t mode = 0;
+	if(flags & O_CREAT){
+		va_list arguments;
+		va_start(arguments, flags);
+		mode = va_arg(arguments, int);
+		va_end(arguments);
+	}
+	return gRealOpen(path, flags, mode);
+}
+
+int close(int descriptor){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "close");
+	return gRealClose(descriptor);
+}
+
+ssize_t read(int descriptor, void* data, size_t count){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "read");
+	return gRealRead(descriptor, data, count);
+}
+
+ssize_t write(int descriptor, const void* data, size_t count){
+	rtAuditRecord(RT_AUDIT_FILE_IO, "write");
+	return gRealWrite(descriptor, data, count);
+}
+
+int pthread_mutex_lock(pthread_mutex_t* mutex){
+	rtAuditRecord(RT_AUDIT_LOCK, "pthread_mutex_lock");
+	return gRealMutexLock(mutex);
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* mutex){
+	rtAuditRecord(RT_AUDIT_LOCK, "pthread_mutex_trylock");
+	return gRealMutexTrylock(mutex);
+}
+
+}
+
+#else // RT_SAFETY_AUDIT
+
+inline void rtAuditMarkRealtimeThread(const char*){}
+inline void rtAuditBeginHop(){}
+inline void rtAuditEndHop(){}
+inline unsigned int rtAuditReport(){
+	return 0;
+}
+
+#endif // RT_SAFETY_AUDIT
+
+#endif //RTAUDIT_H
\ No newline at end of file
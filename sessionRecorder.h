@@ -0,0 +1,250 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef SESSIONRECORDER_H
+#define SESSIONRECORDER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+
+#include "lockFreeRing.h"
+#include "controlParameters.h"
+#include "correctionChannel.h"
+
+// Records a live session so that it can be replayed offline with tools/sessionReplay.cpp
+// The header holds the configuration the channels were built with and the controls when recording started
+// render() hands over each input block with the state of the digital inputs (the buttons) and any controls changed
+// from outside render() since the last block, and the processing thread hands over the frame at which each hop was processed
+// All go through lock-free rings and a background (non real-time) thread writes them to a binary file
+//
+// File layout: a sessionHeader, then sessionEvents in the order they were written
+// SESSION_BLOCK events are followed by blockSize * channels interleaved float samples
+// SESSION_CONTROLS events are followed by a sessionControls, which applied from the start of the block at their frame
+// SESSION_HOP and SESSION_CONTROLS events can come after later blocks, so readers should collect them up front
+
+#define SESSION_MAGIC 0x52534350 // "PCSR"
+#define SESSION_VERSION 3 // Versions 1 and 2 didn't record the configuration or control changes, so can't be replayed
+
+enum{ // Event types
+	SESSION_BLOCK = 0,
+	SESSION_HOP,
+	SESSION_CONTROLS
+};
+
+// The controls render() publishes, apart from the buttons, which are recorded with each block
+struct sessionControls{
+	int32_t scale;
+	int32_t key; // Semitones above C
+	float strength; // Share of the correction applied
+	int32_t engines[CONTROL_MAX_CHANNELS]; // Correction engine of each channel
+};
+
+struct sessionHeader{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t headerSize; // sizeof(sessionHeader) when recorded
+	float sampleRate;
+	uint32_t channels;
+	uint32_t blockSize;
+	uint32_t windowSize;
+	uint32_t hopSize;
+	uint32_t detectionWindowSize; // Pitch detection window, which is longer than windowSize in the low-latency mode
+	uint32_t analysisInterval; // Hops between pitch detections
+	int32_t lateHopPolicy;
+	uint32_t voices;
+	uint32_t decimatedAnalysis;
+	uint32_t decimationFactor;
+	uint32_t fixedPoint;
+	uint32_t formantPreservation;
+	sessionControls controls; // Controls when recording started
+};
+
+struct sessionEvent{
+	uint32_t type;
+	uint32_t sequence; // Hop sequence number, for SESSION_HOP
+	uint64_t frame; // First frame of the block, or the frame render() was on when the hop started processing
+	uint32_t digital; // Digital input states at the start of the block, one bit per pin
+	int32_t lateFrames; // For SESSION_HOP
+};
+
+// A SESSION_CONTROLS event waiting to be written
+struct sessionControlsChange{
+	uint64_t frame;
+	sessionControls controls;
+};
+
+class sessionRecorder{
+public:
+	// Constructor, to be called in setup() once the channels are built from config. Buffers about bufferSeconds of blocks
+	// in case the disk stalls
+	sessionRecorder(BelaContext *context, const correctionConfig& config, int analysisInterval, int lateHopPolicy,
+		const sessionControls& controls, float bufferSeconds = 2.0)
+	:channels(context->audioInChannels), blockSize(context->audioFrames),
+	blocks(bufferSeconds * context->audioSampleRate / context->audioFrames), hops(256), controlChanges(64){
+		header = {};
+		header.magic = SESSION_MAGIC;
+		header.version = SESSION_VERSION;
+		header.headerSize = sizeof(sessionHeader);
+		header.sampleRate = context->audioSampleRate;
+		header.channels = channels;
+		header.blockSize = blockSize;
+		header.windowSize = config.windowSize;
+		header.hopSize = config.hopSize;
+		header.detectionWindowSize = config.detectionWindowSize;
+		header.analysisInterval = analysisInterval;
+		header.lateHopPolicy = lateHopPolicy;
+		header.voices = config.voices;
+		header.decimatedAnalysis = config.decimatedAnalysis;
+		header.decimationFactor = config.decimationFactor;
+		header.fixedPoint = config.fixedPoint;
+		header.formantPreservation = config.formantPreservation;
+		header.controls = controls;
+		lastControls = controls;
+
+		// One slot of samples per entry in the block ring
+		blockPool = (float*)malloc(blocks.returnCapacity() * blockSize * channels * sizeof(float));
+	}
+
+	~sessionRecorder(){ // Destructor
+		stop();
+		free(blockPool);
+		rt_printf("Session recorder deleted.\n");
+	}
+
+	// Open the file and start the writer thread. Returns false if the file couldn't be opened
+	bool start(const char* path){
+		file = fopen(path, "wb");
+		if(file == nullptr){
+			rt_printf("Couldn't open session file %s\n", path);
+			return false;
+		}
+		fwrite(&header, sizeof(header), 1, file);
+		running = true;
+		writer = std::thread(&sessionRecorder::writeEvents, this);
+		return true;
+	}
+
+	void stop(){
+		if(running){
+			running = false;
+			writer.join();
+		}
+		if(file){
+			fclose(file);
+			file = nullptr;
+			if(droppedEvents > 0){
+				rt_printf("Session recorder dropped %u events. The recording can't be replayed exactly\n", droppedEvents.load());
+			}
+		}
+	}
+
+	// ---- Producers ---- //
+
+	// Record the input block and digital inputs. Call from render() before the buttons are updated
+	inline void recordBlock(BelaContext *context){
+		if(blocks.size() >= blocks.returnCapacity()){
+			droppedEvents++;
+			return;
+		}
+
+		sessionEvent event = {};
+		event.type = SESSION_BLOCK;
+		event.frame = context->audioFramesElapsed;
+		event.digital = context->digital[0] >> 16; // Input states are in the upper half of each digital frame
+		event.sequence = blockCount++ & (blocks.returnCapacity() - 1); // Slot in the pool
+
+		float* slot = blockPool + event.sequence * blockSize * channels;
+		for(unsigned int n = 0; n < blockSize; n++){
+			for(unsigned int channel = 0; channel < channels; channel++){
+				slot[n * channels + channel] = audioRead(context, n, channel);
+			}
+		}
+		blocks.push(event);
+	}
+
+	// Record the controls set from outside render() if they have changed since the last block. Call from render() after
+	// recordBlock() and before the buttons are updated, so that replaying the buttons makes the same changes as they did
+	inline void recordControls(BelaContext *context, const sessionControls& controls){
+		if(memcmp(&controls, &lastControls, sizeof(controls)) == 0){
+			return;
+		}
+		sessionControlsChange change;
+		change.frame = context->audioFramesElapsed;
+		change.controls = controls;
+		if(!controlChanges.push(change)){
+			droppedEvents++;
+			return;
+		}
+		lastControls = controls;
+	}
+
+	// Record when a hop was processed. Call from the processing thread
+	inline void recordHop(uint32_t sequence, uint64_t frame, int lateFrames){
+		sessionEvent event = {};
+		event.type = SESSION_HOP;
+		event.sequence = sequence;
+		event.frame = frame;
+		event.lateFrames = lateFrames;
+		if(!hops.push(event)){
+			droppedEvents++;
+		}
+	}
+
+private:
+	// Writer thread
+	void writeEvents(){
+		while(running){
+			drain();
+			usleep(10000);
+		}
+		drain();
+	}
+
+	void drain(){
+		sessionEvent event;
+		while(hops.pop(event)){
+			fwrite(&event, sizeof(event), 1, file);
+		}
+		sessionControlsChange change;
+		while(controlChanges.pop(change)){
+			event = {};
+			event.type = SESSION_CONTROLS;
+			event.frame = change.frame;
+			fwrite(&event, sizeof(event), 1, file);
+			fwrite(&change.controls, sizeof(change.controls), 1, file);
+		}
+		// Blocks are only released once their samples have been written, so the slot can't be reused early
+		while(blocks.peek(event)){
+			uint32_t slot = event.sequence;
+			event.sequence = 0;
+			fwrite(&event, sizeof(event), 1, file);
+			fwrite(blockPool + slot * blockSize * channels, sizeof(float), blockSize * channels, file);
+			blocks.pop(event);
+		}
+	}
+
+	const unsigned int channels;
+	const unsigned int blockSize;
+	sessionHeader header;
+
+	lockFreeRing<sessionEvent> blocks; // Written by render()
+	lockFreeRing<sessionEvent> hops; // Written by the processing thread
+	lockFreeRing<sessionControlsChange> controlChanges; // Written by render()
+	float* blockPool;
+	uint32_t blockCount = 0; // Only used by render()
+	sessionControls lastControls; // Only used by render()
+	std::atomic<unsigned int> droppedEvents{0};
+
+	std::thread writer;
+	std::atomic<bool> running{false};
+	FILE* file = nullptr;
+};
+
+#endif //SESSIONRECORDER_H
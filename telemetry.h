@@ -0,0 +1,324 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <atomic>
+#include <thread>
+
+#include "lockFreeRing.h"
+#include "hopScheduler.h"
+
+// Binary telemetry from the real-time threads
+// Producers push fixed-size records into lock-free rings instead of formatting text
+// A background (non real-time) thread drains them, and can:
+//   write every nth record per channel to a binary file, after a telemetryFileHeader
+//   send them as datagrams to a local (UNIX domain) socket
+//   print an aggregated summary per channel to the console at a fixed interval
+// Records still in the rings when the consumer is stopped are handled before it returns
+
+#define TELEMETRY_MAGIC 0x4d4c4554 // "TELM"
+#define TELEMETRY_VERSION 2 // Version 1 files had no header, and records with four stage times
+
+enum{ // Record types
+	TELEMETRY_PITCH = 0, // One per channel per processed hop
+	TELEMETRY_HOP, // One per hop, with its outcome
+	TELEMETRY_SCALE_CHANGE
+};
+
+enum{ // Processing stages timed in each pitch record
+	TELEMETRY_STAGE_FFT = 0,
+	TELEMETRY_STAGE_PITCH,
+	TELEMETRY_STAGE_CORRECTION,
+	TELEMETRY_STAGE_IFFT,
+	TELEMETRY_STAGE_ENVELOPE, // Formant envelope estimation. Applying it is part of the correction stage
+	TELEMETRY_STAGES
+};
+
+// A telemetry record. Written to files and sockets as it is laid out here
+struct telemetryRecord{
+	uint64_t timestamp; // Monotonic clock, nanoseconds
+	uint32_t sequence; // Hop sequence number
+	uint16_t type;
+	uint16_t channel;
+	int32_t scale; // Scale used for correction
+	int32_t peakBin;
+	int32_t lateFrames; // How late processing of the hop started, in frames. Negative if on time
+	int32_t outcome; // What happened to the hop - see hopScheduler.h
+	float fundamentalFrequency; // 0 if no pitch was detected
+	float desiredNote;
+	float confidence; // Share of the HPS energy in the peak, from 0 to 1
+	uint32_t stageTimes[TELEMETRY_STAGES]; // Nanoseconds spent in each stage
+};
+
+// Written once at the start of a telemetry file, so that readers can check the record layout
+struct telemetryFileHeader{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t recordSize; // sizeof(telemetryRecord)
+	uint32_t stages; // TELEMETRY_STAGES, the number of stage times in each record
+};
+
+class telemetry{
+public:
+	telemetry(int numChannels, int capacity = 1024):channels(numChannels), processingRecords(capacity), controlRecords(64){ // Constructor, to be called in setup()
+		summaries = (channelSummary*)malloc(channels * sizeof(channelSummary));
+		decimationCounters = (int*)malloc(channels * sizeof(int));
+		memset(decimationCounters, 0, channels * sizeof(int));
+		resetSummaries();
+	}
+
+	~telemetry(){ // Destructor
+		stop();
+		free(summaries);
+		free(decimationCounters);
+		rt_printf("Telemetry deleted.\n");
+	}
+
+	// ---- Configuration, before start() ---- //
+
+	// Write records to a binary file
+	void writeToFile(const char* path){
+		file = fopen(path, "wb");
+		if(file == nullptr){
+			rt_printf("Couldn't open telemetry file %s\n", path);
+			return;
+		}
+		telemetryFileHeader header;
+		header.magic = TELEMETRY_MAGIC;
+		header.version = TELEMETRY_VERSION;
+		header.recordSize = sizeof(telemetryRecord);
+		header.stages = TELEMETRY_STAGES;
+		fwrite(&header, sizeof(header), 1, file);
+	}
+
+	// Send records as datagrams to a UNIX domain socket
+	void sendToSocket(const char* path){
+		socketDescriptor = socket(AF_UNIX, SOCK_DGRAM, 0);
+		memset(&socketAddress, 0, sizeof(socketAddress));
+		socketAddress.sun_family = AF_UNIX;
+		strncpy(socketAddress.sun_path, path, sizeof(socketAddress.sun_path) - 1);
+	}
+
+	// Only pass on every nth pitch record of each channel to the file and socket
+	void setDecimation(int n){
+		decimation = n > 0 ? n : 1;
+	}
+
+	// Print a summary of each channel to the console every interval seconds. 0 disables
+	void setSummaryInterval(float seconds){
+		summaryInterval = seconds * 1e9;
+	}
+
+	// Names printed for scale changes
+	void setScaleNames(const char** names, int count){
+		scaleNames = names;
+		scaleNameCount = count;
+	}
+
+	// Start and stop the consumer thread
+	void start(){
+		running = true;
+		consumer = std::thread(&telemetry::consume, this);
+	}
+
+	void stop(){
+		if(running){
+			running = false;
+			consumer.join();
+		}
+		if(file){
+			fclose(file);
+			file = nullptr;
+		}
+		if(socketDescriptor >= 0){
+			::close(socketDescriptor);
+			socketDescriptor = -1;
+		}
+	}
+
+	// ---- Producers ---- //
+
+	// Push a record from the processing thread. Records are dropped and counted if the ring is full
+	inline void pushRecord(const telemetryRecord& record){
+		if(!processingRecords.push(record)){
+			droppedRecords++;
+		}
+	}
+
+	// Push a record from the render thread
+	inline void pushControlRecord(const telemetryRecord& record){
+		if(!controlRecords.push(record)){
+			droppedRecords++;
+		}
+	}
+
+	// Monotonic time in nanoseconds, for timestamps and stage timings
+	static inline uint64_t now(){
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return (uint64_t)time.tv_sec * 1000000000ULL + time.tv_nsec;
+	}
+
+private:
+	// Running statistics for one channel
+	struct channelSummary{
+		int hops;
+		int detections;
+		float frequencySum;
+		float desiredSum;
+		float confidenceSum;
+		uint32_t worstStageTimes[TELEMETRY_STAGES];
+	};
+
+	// Consumer thread
+	void consume(){
+		uint64_t lastSummary = now();
+		while(running){
+			drain();
+
+			if(summaryInterval > 0 && now() - lastSummary > summaryInterval){
+				printSummary();
+				lastSummary = now();
+			}
+
+			usleep(10000);
+		}
+
+		// Records pushed since the last pass, such as those of the final hops, still go to the file and socket
+		drain();
+	}
+
+	void drain(){
+		telemetryRecord record;
+		while(controlRecords.pop(record)){
+			handleRecord(record);
+		}
+		while(processingRecords.pop(record)){
+			handleRecord(record);
+		}
+	}
+
+	void handleRecord(telemetryRecord& record){
+		if(record.type == TELEMETRY_SCALE_CHANGE){
+			if(record.scale >= 0 && record.scale < scaleNameCount){
+				printf("%s\n", scaleNames[record.scale]);
+			}
+			else{
+				printf("Scale %d\n", record.scale);
+			}
+			output(record);
+			return;
+		}
+
+		if(record.type == TELEMETRY_HOP){
+			if(record.outcome >= 0 && record.outcome < HOP_OUTCOMES){
+				hopOutcomes[record.outcome]++;
+			}
+			if(record.outcome != HOP_ON_TIME){
+				output(record);
+			}
+			return;
+		}
+
+		if(record.channel >= channels){
+			return;
+		}
+
+		// Aggregate
+		channelSummary& summary = summaries[record.channel];
+		summary.hops++;
+		if(record.fundamentalFrequency != 0){
+			summary.detections++;
+			summary.frequencySum += record.fundamentalFrequency;
+			summary.desiredSum += record.desiredNote;
+			summary.confidenceSum += record.confidence;
+		}
+		for(int i = 0; i < TELEMETRY_STAGES; i++){
+			if(record.stageTimes[i] > summary.worstStageTimes[i]){
+				summary.worstStageTimes[i] = record.stageTimes[i];
+			}
+		}
+
+		// Decimate
+		if(++decimationCounters[record.channel] >= decimation){
+			decimationCounters[record.channel] = 0;
+			output(record);
+		}
+	}
+
+	// Pass a record on to the file and socket
+	void output(telemetryRecord& record){
+		if(file){
+			fwrite(&record, sizeof(record), 1, file);
+		}
+		if(socketDescriptor >= 0){
+			sendto(socketDescriptor, &record, sizeof(record), MSG_DONTWAIT, (sockaddr*)&socketAddress, sizeof(socketAddress));
+		}
+	}
+
+	void printSummary(){
+		for(int channel = 0; channel < channels; channel++){
+			channelSummary& summary = summaries[channel];
+			if(summary.hops == 0){
+				continue;
+			}
+			float detections = summary.detections > 0 ? summary.detections : 1;
+			printf("Channel %d: %d hops, fundamental %.1fHz -> %.1fHz, confidence %.2f, worst us fft %u pitch %u envelope %u correction %u ifft %u\n",
+				channel, summary.hops, summary.frequencySum / detections, summary.desiredSum / detections, summary.confidenceSum / detections,
+				summary.worstStageTimes[TELEMETRY_STAGE_FFT] / 1000, summary.worstStageTimes[TELEMETRY_STAGE_PITCH] / 1000,
+				summary.worstStageTimes[TELEMETRY_STAGE_ENVELOPE] / 1000,
+				summary.worstStageTimes[TELEMETRY_STAGE_CORRECTION] / 1000, summary.worstStageTimes[TELEMETRY_STAGE_IFFT] / 1000);
+		}
+		
+		// Report any hops which weren't processed on time
+		for(int i = HOP_ON_TIME + 1; i < HOP_OUTCOMES; i++){
+			if(hopOutcomes[i] > 0){
+				printf("%d hops %s\n", hopOutcomes[i], kHopOutcomeNames[i]);
+			}
+		}
+		
+		unsigned int dropped = droppedRecords.exchange(0);
+		if(dropped > 0){
+			printf("Telemetry dropped %u records\n", dropped);
+		}
+		resetSummaries();
+	}
+
+	void resetSummaries(){
+		memset(summaries, 0, channels * sizeof(channelSummary));
+		memset(hopOutcomes, 0, sizeof(hopOutcomes));
+	}
+
+	const int channels;
+	lockFreeRing<telemetryRecord> processingRecords; // Written by the processing thread
+	lockFreeRing<telemetryRecord> controlRecords; // Written by the render thread
+	std::atomic<unsigned int> droppedRecords{0};
+
+	std::thread consumer;
+	std::atomic<bool> running{false};
+
+	channelSummary* summaries;
+	int hopOutcomes[HOP_OUTCOMES]; // Hops with each outcome since the last summary
+	int* decimationCounters;
+	int decimation = 1;
+	uint64_t summaryInterval = 0;
+	const char** scaleNames = nullptr;
+	int scaleNameCount = 0;
+
+	FILE* file = nullptr;
+	int socketDescriptor = -1;
+	sockaddr_un socketAddress;
+};
+
+#endif //TELEMETRY_H
\ No newline at end of file
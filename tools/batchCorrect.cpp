@@ -0,0 +1,417 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+// Batch pitch correction of WAV files across every core
+// Uses pitchCorrector.h, which runs the same correctionChannel as render.cpp
+// Files are split in time into chunks, which a pool of worker threads corrects independently, every channel at once
+// The engines carry phases and pitch marks from hop to hop which never converge from a different start, so chunks are
+// only split at silent hops, where correctionChannel restarts them (see kSilenceThreshold). Nothing before a silent
+// hop changes the output after it, so a chunk run in from a window and a hop before its boundary, with that output
+// thrown away, gives exactly the frames a single pass would. There's no crossfade, and files without pauses at
+// least a chunk apart are corrected in fewer, longer chunks. With -c 0 files aren't split
+// Chunks are read and written a block of frames at a time, and each task writes only its own frames, so memory is
+// bounded by the block size and the number of threads rather than the length of the files
+// With --check, each output is compared afterwards with a single-threaded pass over its input
+//
+// The job list has one file per line: input output [scale] [key]
+// scale is PENTATONIC, C_MAJOR or C_MINOR (default PENTATONIC). key is a note name or semitones above C (default C)
+// Output is 16-bit, or 32-bit float for float input or with -f
+//
+// Build and run on a workstation from the project directory:
+//   g++ -O2 -std=c++11 -I tools/host -I . tools/batchCorrect.cpp -o batchCorrect -lpthread
+//   ./batchCorrect [-j threads] [-c chunkSeconds] [-e vocoder|psola] [-v voices] [-f] [--check] jobs.txt
+
+#include <Bela.h>
+#include <libraries/ne10/NE10.h>
+
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pitchCorrector.h"
+#include "telemetry.h"
+#include "wavFile.h"
+
+const int kWindowSize = 4096;
+const int kHopSize = kWindowSize / 4;
+const int kPreroll = kWindowSize + kHopSize; // Frames each chunk is run in from before its boundary
+const int kBlockFrames = 65536; // Frames read and written at once. A multiple of kHopSize
+
+const char* kScaleNames[] = {"PENTATONIC", "C_MAJOR", "C_MINOR"};
+const char* kKeyNames[] = {"C", "C#", "D", "D#", "E", "F", "F#", "G", "G#", "A", "A#", "B"};
+const char* kFlatKeyNames[] = {"C", "Db", "D", "Eb", "E", "F", "Gb", "G", "Ab", "A", "Bb", "B"};
+
+struct batchJob{
+	std::string input;
+	std::string output;
+	int scale = 0;
+	int key = 0;
+
+	wavReader reader;
+	wavWriter writer;
+	int outputFormat = WAV_PCM_16;
+	std::once_flag opened;
+	bool failed = false;
+
+	std::vector<int64_t> boundaries; // Chunk k is frames boundaries[k] to boundaries[k + 1]
+	std::atomic<int> chunksDone{0};
+	uint64_t startTime = 0;
+};
+
+// Buffers and a corrector for each channel, owned by one worker thread and reused from task to task
+struct batchWorker{
+	std::vector<pitchCorrector*> correctors;
+	int sampleRate = 0;
+	float* input = nullptr; // A block of interleaved frames
+	float* output = nullptr;
+	uint8_t* raw = nullptr;
+	size_t capacity = 0; // Samples each buffer can hold
+};
+
+std::vector<batchJob*> gJobs;
+std::vector<std::pair<int, int>> gTasks; // Job and chunk
+std::atomic<int> gNextTask(0);
+std::atomic<uint64_t> gBusyTime(0);
+std::mutex gPrintLock;
+int gEngine = ENGINE_PHASE_VOCODER;
+int gVoices = 1; // Voices corrected separately by the phase vocoder
+bool gFloatOutput = false;
+
+// Parse a key as a note name or a number of semitones
+int parseKey(const char* text){
+	for(int i = 0; i < 12; i++){
+		if(strcmp(text, kKeyNames[i]) == 0 || strcmp(text, kFlatKeyNames[i]) == 0){
+			return i;
+		}
+	}
+	return atoi(text) % 12;
+}
+
+int parseScale(const char* text){
+	for(int i = 0; i < 3; i++){
+		if(strcmp(text, kScaleNames[i]) == 0){
+			return i;
+		}
+	}
+	return atoi(text) % 3;
+}
+
+// Make sure a worker's buffers hold a block of channels, with a corrector for each channel running at sampleRate
+void prepareWorker(batchWorker& worker, int channels, int sampleRate){
+	size_t samples = (size_t)kBlockFrames * channels;
+	if(samples > worker.capacity){
+		worker.input = (float*)realloc(worker.input, samples * sizeof(float));
+		worker.output = (float*)realloc(worker.output, samples * sizeof(float));
+		worker.raw = (uint8_t*)realloc(worker.raw, samples * sizeof(float));
+		worker.capacity = samples;
+	}
+	if(worker.sampleRate != sampleRate){
+		for(pitchCorrector* corrector : worker.correctors){
+			delete corrector;
+		}
+		worker.correctors.clear();
+		worker.sampleRate = sampleRate;
+	}
+	while((int)worker.correctors.size() < channels){
+		correctionConfig config;
+		config.windowSize = kWindowSize;
+		config.hopSize = kHopSize;
+		config.sampleRate = sampleRate;
+		config.engine = gEngine;
+		config.voices = gVoices;
+		worker.correctors.push_back(new pitchCorrector(config));
+	}
+}
+
+void releaseWorker(batchWorker& worker){
+	for(pitchCorrector* corrector : worker.correctors){
+		delete corrector;
+	}
+	free(worker.input);
+	free(worker.output);
+	free(worker.raw);
+}
+
+// Clear the correctors of the first channels, ready to correct a job from the start of its input
+void resetCorrectors(batchWorker& worker, batchJob* job, int channels){
+	for(int channel = 0; channel < channels; channel++){
+		worker.correctors[channel]->reset();
+		worker.correctors[channel]->setScale(job->scale);
+		worker.correctors[channel]->setKey(job->key);
+	}
+}
+
+// Feed the block of input starting at frame feed to every channel's corrector, and move feed on past it
+// Input is read until the corrector's output reaches frame end, running on past the end of the file with silence
+// Output frames from start onwards are kept, interleaved in worker.output. Returns how many were kept
+int correctBlock(batchWorker& worker, wavReader& reader, int64_t& feed, int64_t start, int64_t end){
+	int channels = reader.channels;
+	int latency = worker.correctors[0]->returnLatency();
+	int64_t remaining = end + latency - feed;
+	int count = (remaining < kBlockFrames) ? remaining : kBlockFrames;
+	reader.readFrames(feed, count, worker.input, worker.raw);
+
+	int produced = 0;
+	for(int channel = 0; channel < channels; channel++){
+		pitchCorrector* corrector = worker.correctors[channel];
+		produced = 0;
+		for(int i = 0; i < count; i++){
+			float out = corrector->process(worker.input[i * channels + channel]);
+			if(feed + i - latency >= start){
+				worker.output[produced++ * channels + channel] = out;
+			}
+		}
+	}
+	feed += count;
+	return produced;
+}
+
+// Find chunk boundaries for a file, about chunkFrames apart
+// A boundary is a hop before the end of a silent window. The hop which processes that window restarts the engines,
+// and the output of the hops before it ends at the boundary
+std::vector<int64_t> splitFile(wavReader& reader, int64_t chunkFrames){
+	std::vector<int64_t> boundaries(1, 0);
+	if(chunkFrames > 0 && chunkFrames < reader.frames){
+		size_t samples = (size_t)kBlockFrames * reader.channels;
+		float* block = (float*)malloc(samples * sizeof(float));
+		uint8_t* raw = (uint8_t*)malloc(samples * sizeof(float));
+		const int hopsPerWindow = kWindowSize / kHopSize;
+		int quietHops = hopsPerWindow; // Consecutive hops below the threshold. The file starts after silence
+
+		for(int64_t blockStart = 0; blockStart < reader.frames; blockStart += kBlockFrames){
+			reader.readFrames(blockStart, kBlockFrames, block, raw);
+			for(int hop = 0; hop < kBlockFrames / kHopSize; hop++){
+				// The hop is quiet if every sample of every channel is below the threshold
+				bool quiet = true;
+				for(int i = hop * kHopSize * reader.channels; i < (hop + 1) * kHopSize * reader.channels && quiet; i++){
+					quiet = (fabsf(block[i]) < correctionChannel::kSilenceThreshold);
+				}
+				quietHops = quiet ? quietHops + 1 : 0;
+
+				// The window ending with this hop is silent
+				int64_t boundary = blockStart + (int64_t)hop * kHopSize;
+				if(quietHops >= hopsPerWindow && boundary < reader.frames && boundary - boundaries.back() >= chunkFrames){
+					boundaries.push_back(boundary);
+				}
+			}
+		}
+		free(block);
+		free(raw);
+	}
+	boundaries.push_back(reader.frames);
+	return boundaries;
+}
+
+// Correct one chunk of a job
+void processChunk(batchWorker& worker, batchJob* job, int chunk){
+	std::call_once(job->opened, [job]{
+		job->startTime = telemetry::now();
+		if(!job->reader.open(job->input.c_str()) ||
+			!job->writer.open(job->output.c_str(), job->reader.channels, job->reader.sampleRate, job->reader.frames, job->outputFormat)){
+			job->failed = true;
+		}
+	});
+	if(job->failed){
+		return;
+	}
+
+	int channels = job->reader.channels;
+	prepareWorker(worker, channels, job->reader.sampleRate);
+	resetCorrectors(worker, job, channels);
+
+	uint64_t chunkStart = telemetry::now();
+
+	// Run in from before the boundary, so that the restart at the silent hop has a full window
+	int64_t start = job->boundaries[chunk];
+	int64_t end = job->boundaries[chunk + 1];
+	int64_t feed = (start > kPreroll) ? start - kPreroll : 0;
+	int64_t written = start;
+	while(written < end){
+		int produced = correctBlock(worker, job->reader, feed, start, end);
+		job->writer.writeFrames(written, produced, worker.output, worker.raw);
+		written += produced;
+	}
+
+	gBusyTime += telemetry::now() - chunkStart;
+
+	// Close the files once every chunk is done
+	if(++job->chunksDone == (int)job->boundaries.size() - 1){
+		int64_t frames = job->reader.frames;
+		double seconds = (telemetry::now() - job->startTime) * 1e-9;
+		double audio = (double)frames / job->reader.sampleRate;
+		job->reader.close();
+		job->writer.close();
+		std::lock_guard<std::mutex> guard(gPrintLock);
+		printf("%s -> %s: %s in %s, %.1fs of audio in %d chunks in %.2fs (%.1fx real time)\n", job->input.c_str(), job->output.c_str(),
+			kScaleNames[job->scale], kKeyNames[job->key], audio, (int)job->boundaries.size() - 1, seconds, audio / seconds);
+	}
+}
+
+// Compare a finished job's output with a single-threaded pass over its input. Returns the number of samples which differ
+int64_t checkJob(batchWorker& worker, batchJob* job){
+	wavReader input;
+	wavReader output;
+	if(!input.open(job->input.c_str()) || !output.open(job->output.c_str()) || output.frames != input.frames){
+		return input.frames * input.channels;
+	}
+
+	// The reference is rounded to the output format, as the writer does
+	int channels = input.channels;
+	float* result = (float*)malloc((size_t)kBlockFrames * channels * sizeof(float));
+	uint8_t* resultRaw = (uint8_t*)malloc((size_t)kBlockFrames * channels * sizeof(float));
+	int64_t differences = 0;
+	float largest = 0;
+	prepareWorker(worker, channels, input.sampleRate);
+	resetCorrectors(worker, job, channels);
+
+	int64_t feed = 0;
+	int64_t compared = 0;
+	while(compared < input.frames){
+		int produced = correctBlock(worker, input, feed, 0, input.frames);
+		output.readFrames(compared, produced, result, resultRaw);
+		for(int i = 0; i < produced * channels; i++){
+			float expected = worker.output[i];
+			if(output.sampleFormat == WAV_PCM_16){
+				expected = lrintf(fmin(fmax(expected * 32768.0f, -32768.0f), 32767.0f)) / 32768.0f;
+			}
+			float difference = fabsf(result[i] - expected);
+			if(difference > 0){
+				differences++;
+				largest = fmaxf(largest, difference);
+			}
+		}
+		compared += produced;
+	}
+	free(result);
+	free(resultRaw);
+
+	if(differences > 0){
+		printf("Check failed: %s has %lld samples which differ from a single pass, by up to %g\n", job->output.c_str(), (long long)differences, largest);
+	}
+	else{
+		printf("Check passed: %s matches a single pass\n", job->output.c_str());
+	}
+	return differences;
+}
+
+void runWorker(){
+	batchWorker worker;
+	int task;
+	while((task = gNextTask++) < (int)gTasks.size()){
+		processChunk(worker, gJobs[gTasks[task].first], gTasks[task].second);
+	}
+	releaseWorker(worker);
+}
+
+int main(int argc, char** argv){
+	int threads = std::thread::hardware_concurrency();
+	bool check = false;
+	float chunkSeconds = 10;
+	const char* jobListPath = nullptr;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-j") == 0 && i + 1 < argc){
+			threads = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "-c") == 0 && i + 1 < argc){
+			chunkSeconds = atof(argv[++i]);
+		}
+		else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc){
+			gEngine = (strcmp(argv[++i], "psola") == 0) ? ENGINE_PSOLA : ENGINE_PHASE_VOCODER;
+		}
+		else if(strcmp(argv[i], "-v") == 0 && i + 1 < argc){
+			gVoices = atoi(argv[++i]);
+		}
+		else if(strcmp(argv[i], "-f") == 0){
+			gFloatOutput = true;
+		}
+		else if(strcmp(argv[i], "--check") == 0){
+			check = true;
+		}
+		else{
+			jobListPath = argv[i];
+		}
+	}
+	if(jobListPath == nullptr){
+		printf("Usage: batchCorrect [-j threads] [-c chunkSeconds] [-e vocoder|psola] [-v voices] [-f] [--check] jobs.txt\n");
+		return 1;
+	}
+	if(threads < 1){
+		threads = 1;
+	}
+
+	ne10_init();
+
+	// Read the job list, and split each file into chunks
+	FILE* jobList = fopen(jobListPath, "r");
+	if(jobList == nullptr){
+		printf("Couldn't open %s\n", jobListPath);
+		return 1;
+	}
+	char line[4096];
+	double totalAudio = 0;
+	while(fgets(line, sizeof(line), jobList)){
+		char input[2048], output[2048], scale[64] = "PENTATONIC", key[64] = "C";
+		if(line[0] == '#' || sscanf(line, "%2047s %2047s %63s %63s", input, output, scale, key) < 2){
+			continue;
+		}
+
+		batchJob* job = new batchJob;
+		job->input = input;
+		job->output = output;
+		job->scale = parseScale(scale);
+		job->key = parseKey(key);
+
+		// The file is opened again when its first chunk starts
+		wavReader header;
+		if(!header.open(input)){
+			printf("Skipping %s: not a supported WAV file\n", input);
+			delete job;
+			continue;
+		}
+		job->outputFormat = (gFloatOutput || header.sampleFormat == WAV_FLOAT_32) ? WAV_FLOAT_32 : WAV_PCM_16;
+		job->boundaries = splitFile(header, (int64_t)(chunkSeconds * header.sampleRate));
+		totalAudio += (double)header.frames / header.sampleRate;
+
+		for(int chunk = 0; chunk < (int)job->boundaries.size() - 1; chunk++){
+			gTasks.push_back(std::make_pair((int)gJobs.size(), chunk));
+		}
+		gJobs.push_back(job);
+	}
+	fclose(jobList);
+
+	printf("%d files in %d chunks on %d threads\n", (int)gJobs.size(), (int)gTasks.size(), threads);
+
+	uint64_t start = telemetry::now();
+	std::vector<std::thread> pool;
+	for(int i = 0; i < threads; i++){
+		pool.push_back(std::thread(runWorker));
+	}
+	for(std::thread& thread : pool){
+		thread.join();
+	}
+	double seconds = (telemetry::now() - start) * 1e-9;
+
+	int failures = 0;
+	batchWorker checker;
+	for(batchJob* job : gJobs){
+		if(job->failed){
+			printf("Failed: %s -> %s\n", job->input.c_str(), job->output.c_str());
+			failures++;
+		}
+		else if(check && checkJob(checker, job) > 0){
+			failures++;
+		}
+		delete job;
+	}
+	releaseWorker(checker);
+
+	printf("Total: %.1fs of audio in %.2fs, %.1fx real time (%.1fx per thread), %.0f%% of thread time busy\n",
+		totalAudio, seconds, totalAudio / seconds, totalAudio / seconds / threads, 100.0 * gBusyTime * 1e-9 / (seconds * threads));
+
+	return failures > 0 ? 1 : 0;
+}
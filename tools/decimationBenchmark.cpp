@@ -0,0 +1,162 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+// Compares pitch detection on the decimated analysis path against the full-band HPS
+// Synthetic harmonic tones are analysed by both paths and the error and time per hop are reported
+//
+// Build and run on a workstation from the project directory:
+//   g++ -O2 -I tools/host -I . tools/decimationBenchmark.cpp -o decimationBenchmark && ./decimationBenchmark
+
+#include <Bela.h>
+#include <libraries/ne10/NE10.h>
+#include <chrono>
+
+#include "circularBuffer.h"
+#include "fftContainer.h"
+#include "hps.h"
+#include "decimator.h"
+
+#define BUFFER_SIZE 16384
+
+const int kSampleRate = 44100;
+const int kWindowSize = 4096;
+const int kHopSize = kWindowSize / 4;
+const int kDecimationFactor = 4;
+const int kHops = 40; // Number of hops analysed per tone
+
+// Results for one analysis path
+struct pathResult{
+	int hops = 0;
+	int grossErrors = 0; // Estimates more than 50 cents out, which would be corrected to the wrong note
+	double absoluteCents = 0; // Sum of absolute errors of the remaining estimates
+	double seconds = 0; // Time spent analysing
+};
+
+// A harmonic tone with 1/h amplitudes and optional white noise
+float generateSample(int n, float frequency, int harmonics, float noise){
+	float sample = 0;
+	for(int h = 1; h <= harmonics; h++){
+		if(frequency * h < 0.5 * kSampleRate){
+			sample += sin(2 * M_PI * frequency * h * n / kSampleRate) / h;
+		}
+	}
+	return 0.25 * sample + noise * ((float)rand() / RAND_MAX - 0.5);
+}
+
+double timeSince(std::chrono::steady_clock::time_point start){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void score(pathResult& result, float estimate, float frequency){
+	result.hops++;
+	float cents = (estimate > 0) ? 1200 * log2(estimate / frequency) : 1e6;
+	if(fabs(cents) > 50){
+		result.grossErrors++;
+	}
+	else{
+		result.absoluteCents += fabs(cents);
+	}
+}
+
+void printResult(const char* name, pathResult& result){
+	int good = result.hops - result.grossErrors;
+	printf("  %-12s gross errors %5.1f%%  mean error %6.2f cents  %7.1f us/hop\n", name,
+		100.0 * result.grossErrors / result.hops,
+		good > 0 ? result.absoluteCents / good : 0.0,
+		1e6 * result.seconds / result.hops);
+}
+
+int main(){
+	ne10_init();
+	srand(1);
+
+	circularBuffer input(BUFFER_SIZE);
+	decimator decimate(kDecimationFactor, BUFFER_SIZE / kDecimationFactor);
+	FFTContainer fullFFT(kWindowSize, kSampleRate);
+	FFTContainer decimatedFFT(kWindowSize / kDecimationFactor, kSampleRate / kDecimationFactor);
+	HPS fullHPS(kWindowSize, kSampleRate);
+	HPS decimatedHPS(kWindowSize / kDecimationFactor, kSampleRate / kDecimationFactor);
+
+	float* fullWindow = (float*)malloc(kWindowSize * sizeof(float));
+	for(int i = 0; i < kWindowSize; i++){
+		fullWindow[i] = 0.5-(0.5*cos((2*M_PI*(float)i)/((float)kWindowSize-1.0)));
+	}
+	int decimatedSize = kWindowSize / kDecimationFactor;
+	float* decimatedWindow = (float*)malloc(decimatedSize * sizeof(float));
+	for(int i = 0; i < decimatedSize; i++){
+		decimatedWindow[i] = 0.5-(0.5*cos((2*M_PI*(float)i)/((float)decimatedSize-1.0)));
+	}
+
+	float hopSamples[kHopSize];
+	float frequencies[] = {82.41, 110, 146.83, 196, 261.63, 329.63, 440, 587.33, 783.99, 1046.5, 1396.91};
+	float noiseLevels[] = {0, 0.05, 0.2};
+
+	for(float noise : noiseLevels){
+		pathResult full, decimated;
+		for(float frequency : frequencies){
+			int n = 0;
+			for(int hop = 0; hop < kHops; hop++){
+				// Generate the next hop of audio
+				for(int i = 0; i < kHopSize; i++){
+					hopSamples[i] = generateSample(n + i, frequency, 6, noise);
+					input.insert(hopSamples[i]);
+				}
+				n += kHopSize;
+				
+				// Filtering is part of the cost of the decimated path
+				auto start = std::chrono::steady_clock::now();
+				for(int i = 0; i < kHopSize; i++){
+					decimate.process(hopSamples[i]);
+				}
+				decimated.seconds += timeSince(start);
+
+				// Skip hops before the window has filled
+				if(n < kWindowSize){
+					continue;
+				}
+
+				// Full-band HPS
+				start = std::chrono::steady_clock::now();
+				input.setReadPointer(input.returnWritePointer() - kWindowSize);
+				for(int i = 0; i < kWindowSize; i++){
+					fullFFT.timeDomainIn[i].r = input.returnNextElement() * fullWindow[i];
+					fullFFT.timeDomainIn[i].i = 0;
+				}
+				ne10_fft_c2c_1d_float32_neon(fullFFT.frequencyDomain, fullFFT.timeDomainIn, fullFFT.cfg, 0);
+				fullHPS.importSpectrum(fullFFT.frequencyDomain);
+				fullHPS.calculate();
+				float fullEstimate = fullHPS.estimateFundamentalFrequency(fullHPS.returnPeakLocation());
+				full.seconds += timeSince(start);
+				score(full, fullEstimate, frequency);
+
+				// Decimated HPS
+				start = std::chrono::steady_clock::now();
+				circularBuffer* decimatedBuffer = decimate.returnOutputBuffer();
+				decimatedBuffer->setReadPointer(decimatedBuffer->returnWritePointer() - decimatedSize);
+				for(int i = 0; i < decimatedSize; i++){
+					decimatedFFT.timeDomainIn[i].r = decimatedBuffer->returnNextElement() * decimatedWindow[i];
+					decimatedFFT.timeDomainIn[i].i = 0;
+				}
+				ne10_fft_c2c_1d_float32_neon(decimatedFFT.frequencyDomain, decimatedFFT.timeDomainIn, decimatedFFT.cfg, 0);
+				decimatedHPS.importSpectrum(decimatedFFT.frequencyDomain);
+				decimatedHPS.calculate();
+				float decimatedEstimate = decimatedHPS.estimateFundamentalFrequency(decimatedHPS.returnPeakLocation());
+				decimated.seconds += timeSince(start);
+				score(decimated, decimatedEstimate, frequency);
+			}
+		}
+
+		printf("Noise level %.2f\n", noise);
+		printResult("full-band", full);
+		printResult("decimated", decimated);
+	}
+
+	free(fullWindow);
+	free(decimatedWindow);
+
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,220 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+// Accuracy and cost report for the Q31 fixed-point processing mode (gFixedPointProcessing) against the float path
+// Only the window, FFT, IFFT and HPS are fixed point. The correction engines work on a float copy of the spectrum
+// For harmonic tones at a range of levels, reports:
+//   the SNR of the fixed-point spectrum against the float spectrum
+//   the SNR of the fixed-point FFT/IFFT resynthesis against the windowed input
+//   for the float HPS and the fixed-point HPS, the tones with no pitch detected, the tones detected more than
+//   50 cents out, and the mean error in cents of the rest ("-" if there are none)
+// and the highest level at which either HPS misses most tones. Then for each engine, the mean time per hop spent in
+// each stage of a correctionChannel with and without fixed point, which is the real saving (or cost) of the mode
+// The stage times depend on the processor, so should be measured on Bela
+//
+// Build and run on a workstation from the project directory:
+//   g++ -O2 -std=c++11 -I tools/host -I . tools/fixedPointReport.cpp -o fixedPointReport && ./fixedPointReport
+
+#include <Bela.h>
+#include <libraries/ne10/NE10.h>
+
+#include "fftContainer.h"
+#include "hps.h"
+#include "fixedPoint.h"
+#include "correctionChannel.h"
+
+const int kSampleRate = 44100;
+const int kWindowSize = 4096;
+const int kHopSize = kWindowSize / 4;
+const int kTimedHops = 400;
+
+// Pitch accuracy over a set of tones for one path
+struct pitchResult{
+	int estimates = 0;
+	int missed = 0; // No pitch detected
+	int grossErrors = 0; // Detected more than 50 cents out
+	double absoluteCents = 0;
+};
+
+void score(pitchResult& result, float estimate, float frequency){
+	result.estimates++;
+	if(estimate <= 0){
+		result.missed++;
+		return;
+	}
+	float cents = 1200 * log2(estimate / frequency);
+	if(fabs(cents) > 50){
+		result.grossErrors++;
+	}
+	else{
+		result.absoluteCents += fabs(cents);
+	}
+}
+
+// Print the missed and gross error percentages and the mean error of the estimates within 50 cents
+void printPitch(pitchResult& result){
+	int good = result.estimates - result.missed - result.grossErrors;
+	printf(" %10.1f %9.1f", 100.0 * result.missed / result.estimates, 100.0 * result.grossErrors / result.estimates);
+	if(good > 0){
+		printf(" %7.2f", result.absoluteCents / good);
+	}
+	else{
+		printf(" %7s", "-");
+	}
+}
+
+double decibels(double signal, double noise){
+	return (noise > 0) ? 10 * log10(signal / noise) : 999;
+}
+
+// Run a correctionChannel on a harmonic tone, with and without fixed point, and print the mean time per hop of each stage
+void timeStages(){
+	const char* engineNames[] = {"vocoder", "psola"};
+	printf("\nengine  path  fft_us pitch_us correction_us ifft_us total_us\n");
+
+	for(int engine = ENGINE_PHASE_VOCODER; engine <= ENGINE_PSOLA; engine++){
+		double totals[2];
+		for(int fixed = 0; fixed <= 1; fixed++){
+			correctionConfig config;
+			config.windowSize = kWindowSize;
+			config.hopSize = kHopSize;
+			config.sampleRate = kSampleRate;
+			config.fixedPoint = fixed;
+			config.engine = engine;
+			correctionChannel channel(config);
+			correctionControls controls;
+			telemetryRecord record = {};
+
+			double stageTimes[TELEMETRY_STAGES] = {};
+			double phase = 0;
+			for(int hop = 0; hop < kTimedHops; hop++){
+				for(int n = 0; n < kHopSize; n++){
+					phase += 2 * M_PI * 196.0 / kSampleRate;
+					channel.insert(0.2 * (sin(phase) + sin(2 * phase) / 2 + sin(3 * phase) / 3));
+					channel.returnAndEmptyNextElement();
+				}
+				channel.processHop(channel.returnInputPointer(), channel.returnDecimatedPointer(), 0, true, controls, record);
+				for(int i = 0; i < TELEMETRY_STAGES; i++){
+					stageTimes[i] += record.stageTimes[i] / 1000.0;
+				}
+			}
+
+			totals[fixed] = 0;
+			for(int i = 0; i < TELEMETRY_STAGES; i++){
+				stageTimes[i] /= kTimedHops;
+				totals[fixed] += stageTimes[i];
+			}
+			printf("%-7s %-5s %6.1f %8.1f %13.1f %7.1f %8.1f\n", engineNames[engine], fixed ? "fixed" : "float",
+				stageTimes[TELEMETRY_STAGE_FFT], stageTimes[TELEMETRY_STAGE_PITCH], stageTimes[TELEMETRY_STAGE_CORRECTION],
+				stageTimes[TELEMETRY_STAGE_IFFT], totals[fixed]);
+		}
+		printf("%-7s saving per hop %.1fus (%.0f%%)\n", engineNames[engine], totals[0] - totals[1],
+			100.0 * (totals[0] - totals[1]) / totals[0]);
+	}
+}
+
+int main(){
+	ne10_init();
+
+	FFTContainer floatFFT(kWindowSize, kSampleRate);
+	FFTContainerQ31 fixedFFT(kWindowSize, kSampleRate);
+	HPS floatHPS(kWindowSize, kSampleRate);
+	HPS fixedHPS(kWindowSize, kSampleRate);
+
+	float* window = (float*)malloc(kWindowSize * sizeof(float));
+	ne10_int32_t* windowQ31 = (ne10_int32_t*)malloc(kWindowSize * sizeof(ne10_int32_t));
+	for(int i = 0; i < kWindowSize; i++){
+		window[i] = 0.5-(0.5*cos((2*M_PI*(float)i)/((float)kWindowSize-1.0)));
+		windowQ31[i] = floatToQ31(window[i]);
+	}
+
+	float frequencies[] = {82.41, 110, 146.83, 196, 261.63, 329.63, 440, 587.33, 783.99, 1046.5, 1396.91, 1975.53};
+	float levels[] = {-6, -20, -30, -40, -50, -60}; // Peak level in dBFS
+	float floatFailure = 0, fixedFailure = 0; // Highest level at which most tones are missed, 0 if none
+
+	printf("level_dbfs spectrum_snr_db resynthesis_snr_db float_missed_pct float_gross_pct float_cents fixed_missed_pct fixed_gross_pct fixed_cents\n");
+
+	for(float level : levels){
+		float amplitude = pow(10, level / 20.0);
+		double spectrumSignal = 0, spectrumNoise = 0;
+		double resynthesisSignal = 0, resynthesisNoise = 0;
+		pitchResult floatPitch, fixedPitch;
+
+		for(float frequency : frequencies){
+			// Harmonic tone with 1/h amplitudes, normalised to the peak level
+			for(int n = 0; n < kWindowSize; n++){
+				float sample = 0;
+				for(int h = 1; h <= 6; h++){
+					sample += sin(2 * M_PI * frequency * h * n / kSampleRate) / h;
+				}
+				sample *= amplitude / 2.45;
+				floatFFT.timeDomainIn[n].r = sample * window[n];
+				floatFFT.timeDomainIn[n].i = 0;
+				fixedFFT.timeDomainIn[n].r = multiplyQ31(floatToQ31(sample), windowQ31[n]);
+				fixedFFT.timeDomainIn[n].i = 0;
+			}
+
+			// Forward transforms
+			ne10_fft_c2c_1d_float32_neon(floatFFT.frequencyDomain, floatFFT.timeDomainIn, floatFFT.cfg, 0);
+			fixedFFT.forward();
+			for(int k = 0; k < kWindowSize; k++){
+				float r = q31ToFloat(fixedFFT.frequencyDomain[k].r, fixedFFT.frequencyExponent);
+				float i = q31ToFloat(fixedFFT.frequencyDomain[k].i, fixedFFT.frequencyExponent);
+				float dr = r - floatFFT.frequencyDomain[k].r;
+				float di = i - floatFFT.frequencyDomain[k].i;
+				spectrumSignal += floatFFT.frequencyDomain[k].r * floatFFT.frequencyDomain[k].r + floatFFT.frequencyDomain[k].i * floatFFT.frequencyDomain[k].i;
+				spectrumNoise += dr * dr + di * di;
+			}
+
+			// Pitch detection on both paths
+			floatHPS.importSpectrum(floatFFT.frequencyDomain);
+			floatHPS.calculate();
+			score(floatPitch, floatHPS.estimateFundamentalFrequency(floatHPS.returnPeakLocation()), frequency);
+
+			fixedHPS.importFixedPointSpectrum(fixedFFT.frequencyDomain, fixedFFT.frequencyExponent);
+			fixedHPS.calculateFixedPoint();
+			score(fixedPitch, fixedHPS.estimateFundamentalFrequency(fixedHPS.returnPeakLocation()), frequency);
+
+			// Resynthesis, as used when processing is disabled
+			fixedFFT.inverse();
+			for(int n = 0; n < kWindowSize; n++){
+				float reference = floatFFT.timeDomainIn[n].r;
+				float difference = q31ToFloat(fixedFFT.timeDomainOut[n].r, fixedFFT.outputExponent) - reference;
+				resynthesisSignal += reference * reference;
+				resynthesisNoise += difference * difference;
+			}
+		}
+
+		printf("%10.0f %15.1f %18.1f      ", level, decibels(spectrumSignal, spectrumNoise), decibels(resynthesisSignal, resynthesisNoise));
+		printPitch(floatPitch);
+		printf("      ");
+		printPitch(fixedPitch);
+		printf("\n");
+
+		if(floatFailure == 0 && 2 * floatPitch.missed > floatPitch.estimates){
+			floatFailure = level;
+		}
+		if(fixedFailure == 0 && 2 * fixedPitch.missed > fixedPitch.estimates){
+			fixedFailure = level;
+		}
+	}
+
+	free(window);
+	free(windowQ31);
+
+	// Detection failures are flagged, as the errors of the few tones still detected at those levels mean little
+	if(floatFailure != 0){
+		printf("\nFloat pitch detection misses most tones from %.0fdBFS\n", floatFailure);
+	}
+	if(fixedFailure != 0){
+		printf("%sFixed-point pitch detection misses most tones from %.0fdBFS\n", floatFailure != 0 ? "" : "\n", fixedFailure);
+	}
+
+	timeStages();
+
+	return 0;
+}
\ No newline at end of file
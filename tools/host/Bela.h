@@ -0,0 +1,101 @@
+/*
+ * Written for ECS7012U Music and 
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef HOST_BELA_H
+#define HOST_BELA_H
+
+// Minimal stand-in for the parts of the Bela API used by the processing headers and render.cpp
+// Allows the pitch detection and correction code to be built and run on a workstation
+// Build with -Itools/host so that this file is found instead of the real Bela.h
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <fstream>
+
+#include <libraries/ne10/NE10.h>
+
+// There is no Xenomai on the host, so real-time printing is just printing
+// It goes to stderr, keeping stdout clean for tools which write audio or results there
+#define rt_printf(...) fprintf(stderr, __VA_ARGS__)
+
+// ---- Audio and digital I/O ---- //
+
+// The fields of BelaContext used by render.cpp. Audio is interleaved, as it is by default on Bela
+struct BelaContext{
+	float* audioIn;
+	float* audioOut;
+	uint32_t audioFrames;
+	uint32_t audioInChannels;
+	uint32_t audioOutChannels;
+	float audioSampleRate;
+	uint32_t* digital; // One word per frame. Input states are in the upper 16 bits, as on Bela
+	uint32_t digitalFrames;
+	uint32_t digitalChannels;
+	uint64_t audioFramesElapsed;
+};
+
+#define INPUT 0
+#define OUTPUT 1
+
+static inline float audioRead(BelaContext *context, int frame, int channel){
+	return context->audioIn[frame * context->audioInChannels + channel];
+}
+
+static inline void audioWrite(BelaContext *context, int frame, int channel, float value){
+	context->audioOut[frame * context->audioOutChannels + channel] = value;
+}
+
+static inline int digitalRead(BelaContext *context, int frame, int channel){
+	return (context->digital[frame] >> (channel + 16)) & 1;
+}
+
+static inline void pinMode(BelaContext *, int, int, int){
+}
+
+// ---- Auxiliary tasks ---- //
+
+// There are no threads behind auxiliary tasks on the host
+// Scheduling a task marks it as pending, and the host program decides when it runs with hostRunAuxiliaryTask()
+// This keeps offline runs deterministic
+struct hostAuxiliaryTask{
+	void (*callback)(void*);
+	void* argument;
+	const char* name;
+	bool pending;
+};
+
+typedef hostAuxiliaryTask* AuxiliaryTask;
+
+static inline AuxiliaryTask Bela_createAuxiliaryTask(void (*callback)(void*), int, const char* name, void* argument = nullptr){
+	AuxiliaryTask task = (AuxiliaryTask)malloc(sizeof(hostAuxiliaryTask));
+	task->callback = callback;
+	task->argument = argument;
+	task->name = name;
+	task->pending = false;
+	return task;
+}
+
+static inline int Bela_scheduleAuxiliaryTask(AuxiliaryTask task){
+	task->pending = true;
+	return 0;
+}
+
+// Host only: run a task if it has been scheduled. Returns true if it ran
+static inline bool hostRunAuxiliaryTask(AuxiliaryTask task){
+	if(task == nullptr || task->pending == false){
+		return false;
+	}
+	task->pending = false;
+	task->callback(task->argument);
+	return true;
+}
+
+#endif //HOST_BELA_H
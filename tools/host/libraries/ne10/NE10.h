@@ -0,0 +1,224 @@
+/*
+ * Written for ECS7012U Music and 
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef HOST_NE10_H
+#define HOST_NE10_H
+
+// Portable stand-in for the subset of the Ne10 library used by this project
+// The "neon" entry points are provided with the same signatures and scaling as Ne10
+// so that code written for Bela builds unchanged on a workstation
+// Transforms are plain radix-2, so sizes must be powers of two
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NE10_OK 0
+#define NE10_ERR -1
+
+#define NE10_MALLOC malloc
+#define NE10_FREE free
+
+typedef float ne10_float32_t;
+typedef int ne10_int32_t;
+typedef unsigned int ne10_uint32_t;
+typedef long long ne10_int64_t;
+typedef int ne10_result_t;
+
+typedef struct{
+	ne10_float32_t r;
+	ne10_float32_t i;
+} ne10_fft_cpx_float32_t;
+
+typedef struct{
+	ne10_int32_t nfft;
+	ne10_fft_cpx_float32_t* twiddles;
+} ne10_fft_state_float32_t;
+
+typedef ne10_fft_state_float32_t* ne10_fft_cfg_float32_t;
+
+typedef struct{
+	ne10_int32_t r;
+	ne10_int32_t i;
+} ne10_fft_cpx_int32_t;
+
+typedef struct{
+	ne10_int32_t nfft;
+	ne10_fft_cpx_int32_t* twiddles; // Q31
+} ne10_fft_state_int32_t;
+
+typedef ne10_fft_state_int32_t* ne10_fft_cfg_int32_t;
+
+inline ne10_result_t ne10_init(){
+	return NE10_OK;
+}
+
+// Allocate a configuration. Twiddles live in the same block so NE10_FREE(cfg) releases everything, as in Ne10
+inline ne10_fft_cfg_float32_t ne10_fft_alloc_c2c_float32_c(ne10_int32_t nfft){
+	ne10_fft_cfg_float32_t cfg = (ne10_fft_cfg_float32_t)NE10_MALLOC(sizeof(ne10_fft_state_float32_t) + (nfft / 2) * sizeof(ne10_fft_cpx_float32_t));
+	cfg->nfft = nfft;
+	cfg->twiddles = (ne10_fft_cpx_float32_t*)(cfg + 1);
+	for(int i = 0; i < nfft / 2; i++){
+		cfg->twiddles[i].r = cos(-2 * M_PI * i / nfft);
+		cfg->twiddles[i].i = sin(-2 * M_PI * i / nfft);
+	}
+	return cfg;
+}
+
+inline ne10_fft_cfg_float32_t ne10_fft_alloc_c2c_float32_neon(ne10_int32_t nfft){
+	return ne10_fft_alloc_c2c_float32_c(nfft);
+}
+
+inline void ne10_fft_destroy_c2c_float32(ne10_fft_cfg_float32_t cfg){
+	NE10_FREE(cfg);
+}
+
+// Complex to complex transform. The inverse is scaled by 1/nfft, as in Ne10
+inline void ne10_fft_c2c_1d_float32_c(ne10_fft_cpx_float32_t* fout, ne10_fft_cpx_float32_t* fin, ne10_fft_cfg_float32_t cfg, ne10_int32_t inverse_fft){
+	const int n = cfg->nfft;
+
+	// Bit reversed copy, which also allows fin == fout
+	if(fin == fout){
+		for(int i = 1, j = 0; i < n; i++){
+			int bit = n >> 1;
+			for(; j & bit; bit >>= 1){
+				j ^= bit;
+			}
+			j ^= bit;
+			if(i < j){
+				ne10_fft_cpx_float32_t temp = fout[i];
+				fout[i] = fout[j];
+				fout[j] = temp;
+			}
+		}
+	}
+	else{
+		for(int i = 0, j = 0; i < n; i++){
+			fout[j] = fin[i];
+			int bit = n >> 1;
+			for(; j & bit; bit >>= 1){
+				j ^= bit;
+			}
+			j ^= bit;
+		}
+	}
+
+	// Butterflies
+	for(int length = 2; length <= n; length <<= 1){
+		int half = length >> 1;
+		int step = n / length;
+		for(int start = 0; start < n; start += length){
+			for(int k = 0; k < half; k++){
+				ne10_float32_t wr = cfg->twiddles[k * step].r;
+				ne10_float32_t wi = inverse_fft ? -cfg->twiddles[k * step].i : cfg->twiddles[k * step].i;
+				ne10_fft_cpx_float32_t* a = &fout[start + k];
+				ne10_fft_cpx_float32_t* b = &fout[start + k + half];
+				ne10_float32_t tr = b->r * wr - b->i * wi;
+				ne10_float32_t ti = b->r * wi + b->i * wr;
+				b->r = a->r - tr;
+				b->i = a->i - ti;
+				a->r += tr;
+				a->i += ti;
+			}
+		}
+	}
+
+	if(inverse_fft){
+		ne10_float32_t scale = 1.0 / n;
+		for(int i = 0; i < n; i++){
+			fout[i].r *= scale;
+			fout[i].i *= scale;
+		}
+	}
+}
+
+inline void ne10_fft_c2c_1d_float32_neon(ne10_fft_cpx_float32_t* fout, ne10_fft_cpx_float32_t* fin, ne10_fft_cfg_float32_t cfg, ne10_int32_t inverse_fft){
+	ne10_fft_c2c_1d_float32_c(fout, fin, cfg, inverse_fft);
+}
+
+// Q31 fixed-point configuration
+inline ne10_fft_cfg_int32_t ne10_fft_alloc_c2c_int32_c(ne10_int32_t nfft){
+	ne10_fft_cfg_int32_t cfg = (ne10_fft_cfg_int32_t)NE10_MALLOC(sizeof(ne10_fft_state_int32_t) + (nfft / 2) * sizeof(ne10_fft_cpx_int32_t));
+	cfg->nfft = nfft;
+	cfg->twiddles = (ne10_fft_cpx_int32_t*)(cfg + 1);
+	for(int i = 0; i < nfft / 2; i++){
+		double r = cos(-2 * M_PI * i / nfft) * 2147483647.0;
+		double im = sin(-2 * M_PI * i / nfft) * 2147483647.0;
+		cfg->twiddles[i].r = (ne10_int32_t)(r + (r >= 0 ? 0.5 : -0.5));
+		cfg->twiddles[i].i = (ne10_int32_t)(im + (im >= 0 ? 0.5 : -0.5));
+	}
+	return cfg;
+}
+
+inline ne10_fft_cfg_int32_t ne10_fft_alloc_c2c_int32_neon(ne10_int32_t nfft){
+	return ne10_fft_alloc_c2c_int32_c(nfft);
+}
+
+// Q31 complex to complex transform
+// With scaled_flag set, each stage halves its inputs so the result is divided by nfft and cannot overflow, as in Ne10
+inline void ne10_fft_c2c_1d_int32_c(ne10_fft_cpx_int32_t* fout, ne10_fft_cpx_int32_t* fin, ne10_fft_cfg_int32_t cfg, ne10_int32_t inverse_fft, ne10_int32_t scaled_flag){
+	const int n = cfg->nfft;
+
+	// Bit reversed copy
+	if(fin == fout){
+		for(int i = 1, j = 0; i < n; i++){
+			int bit = n >> 1;
+			for(; j & bit; bit >>= 1){
+				j ^= bit;
+			}
+			j ^= bit;
+			if(i < j){
+				ne10_fft_cpx_int32_t temp = fout[i];
+				fout[i] = fout[j];
+				fout[j] = temp;
+			}
+		}
+	}
+	else{
+		for(int i = 0, j = 0; i < n; i++){
+			fout[j] = fin[i];
+			int bit = n >> 1;
+			for(; j & bit; bit >>= 1){
+				j ^= bit;
+			}
+			j ^= bit;
+		}
+	}
+
+	// Butterflies
+	for(int length = 2; length <= n; length <<= 1){
+		int half = length >> 1;
+		int step = n / length;
+		for(int start = 0; start < n; start += length){
+			for(int k = 0; k < half; k++){
+				ne10_int64_t wr = cfg->twiddles[k * step].r;
+				ne10_int64_t wi = inverse_fft ? -(ne10_int64_t)cfg->twiddles[k * step].i : cfg->twiddles[k * step].i;
+				ne10_fft_cpx_int32_t* a = &fout[start + k];
+				ne10_fft_cpx_int32_t* b = &fout[start + k + half];
+				ne10_int64_t ar = a->r, ai = a->i, br = b->r, bi = b->i;
+				if(scaled_flag){
+					ar >>= 1;
+					ai >>= 1;
+					br >>= 1;
+					bi >>= 1;
+				}
+				ne10_int64_t tr = (br * wr - bi * wi) >> 31;
+				ne10_int64_t ti = (br * wi + bi * wr) >> 31;
+				b->r = (ne10_int32_t)(ar - tr);
+				b->i = (ne10_int32_t)(ai - ti);
+				a->r = (ne10_int32_t)(ar + tr);
+				a->i = (ne10_int32_t)(ai + ti);
+			}
+		}
+	}
+}
+
+inline void ne10_fft_c2c_1d_int32_neon(ne10_fft_cpx_int32_t* fout, ne10_fft_cpx_int32_t* fin, ne10_fft_cfg_int32_t cfg, ne10_int32_t inverse_fft, ne10_int32_t scaled_flag){
+	ne10_fft_c2c_1d_int32_c(fout, fin, cfg, inverse_fft, scaled_flag);
+}
+
+#endif //HOST_NE10_H
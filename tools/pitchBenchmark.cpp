@@ -0,0 +1,598 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+// Pitch detection and correction benchmark on a synthetic test corpus
+// The corpus is generated here with a fixed seed, so every run analyses the same audio:
+//   pure tones, harmonic tones, vibrato, glides, harmonic tones in white noise at 20, 10 and 0dB SNR, and major triads
+// Each test signal starts after a window of silence and lasts 1.5s, at a range of fundamentals from 82Hz to 790Hz
+//
+// Detection rows run each pitch detector (float HPS, Q31 fixed-point HPS, decimated HPS) at each window and hop size
+// Correction rows run each correction engine through pitchCorrector, and measure the strongest partial of its output
+// within 150 cents of the note it should have been corrected to, with an 8192 point FFT. A partial on the wrong note is
+// measured at the edge of that range, so still counts as a gross error. Glides and chords have no single target note, so
+// they are skipped
+//
+// One row per engine, configuration and signal is printed to stdout as whitespace separated columns:
+//   stage        detect or correct
+//   engine       float, fixed or decimated for detection, vocoder or psola for correction
+//   window hop   analysis window and hop size in samples
+//   lag threshold  peak detection settings (see detectPeaks())
+//   signal       test signal
+//   hops         estimates scored
+//   gross_pct    estimates more than 50 cents out, which would be corrected to the wrong note
+//   cents        mean absolute error of the remaining estimates
+//   latency_ms   from the onset to the end of the first window detected within 50 cents, averaged over fundamentals
+//                For correction, the output delay is added. -1 if no fundamental was ever detected
+//   us_per_hop   processing time per hop. For correction this is the whole of pitchCorrector::process()
+// The cheapest detector and engine meeting the accuracy bar on the chosen signals are then reported on stderr
+// HPS needs harmonics, so pure tones and chords are reported but by default left out of the bar
+//
+// Build and run on a workstation from the project directory:
+//   g++ -O2 -std=c++11 -I tools/host -I . tools/pitchBenchmark.cpp -o pitchBenchmark && ./pitchBenchmark > results.txt
+//
+// Options:
+//   -l lags        comma separated peak detection lags to compare (5)
+//   -t thresholds  comma separated peak detection thresholds to compare (20)
+//   -g percent     largest gross error rate for the accuracy bar (5)
+//   -m cents       largest mean error for the accuracy bar (10)
+//   -s signals     comma separated signals the accuracy bar applies to (harmonic,vibrato,glide,noise_20db,noise_10db,noise_0db)
+
+#include <Bela.h>
+#include <libraries/ne10/NE10.h>
+#include <chrono>
+
+#include "circularBuffer.h"
+#include "fftContainer.h"
+#include "hps.h"
+#include "decimator.h"
+#include "pitchCorrector.h"
+
+#define BUFFER_SIZE 32768
+
+const int kSampleRate = 44100;
+const float kToneSeconds = 1.5;
+const int kDecimationFactor = 4;
+const int kReferenceWindowSize = 8192; // Analysis of the corrected output
+const int kReferenceHopSize = 2048;
+const float kReferenceRange = 150; // Cents either side of the target searched for the corrected partial
+const int kScale = 0;
+
+// Window and hop sizes compared
+const int kConfigurations[][2] = {{2048, 512}, {4096, 1024}, {4096, 512}, {8192, 2048}};
+
+// Fundamentals, 20 cents above notes of the chromatic scale so that correction has something to do
+const float kNotes[] = {82.41, 110, 146.83, 196, 261.63, 329.63, 440, 587.33, 783.99};
+const float kDetune = 20;
+
+enum{ // Kinds of test signal
+	SIGNAL_TONE = 0, // Sine at the fundamental
+	SIGNAL_HARMONIC, // Six harmonics with 1/h amplitudes
+	SIGNAL_VIBRATO, // Harmonic, with 20 cents of vibrato at 5.5Hz
+	SIGNAL_GLIDE, // Harmonic, rising an octave every 2 seconds
+	SIGNAL_CHORD // Major triad of harmonic tones. The root is the reference
+};
+
+struct corpusEntry{
+	const char* name;
+	int type;
+	float snr; // White noise level in dB below the signal. Above 200 there is no noise
+	bool correctable; // Whether the signal has a single note to correct to
+	bool inBar; // Whether the accuracy bar applies to it
+};
+
+corpusEntry kCorpus[] = {
+	{"tone", SIGNAL_TONE, 999, true, false},
+	{"harmonic", SIGNAL_HARMONIC, 999, true, true},
+	{"vibrato", SIGNAL_VIBRATO, 999, true, true},
+	{"glide", SIGNAL_GLIDE, 999, false, true},
+	{"noise_20db", SIGNAL_HARMONIC, 20, true, true},
+	{"noise_10db", SIGNAL_HARMONIC, 10, true, true},
+	{"noise_0db", SIGNAL_HARMONIC, 0, true, true},
+	{"chord", SIGNAL_CHORD, 999, false, false}
+};
+const int kCorpusSize = sizeof(kCorpus) / sizeof(kCorpus[0]);
+
+enum{ // Pitch detectors
+	DETECTOR_FLOAT = 0,
+	DETECTOR_FIXED,
+	DETECTOR_DECIMATED,
+	DETECTORS
+};
+const char* kDetectorNames[] = {"float", "fixed", "decimated"};
+const char* kEngineNames[] = {"vocoder", "psola"};
+
+// One test signal, generated a sample at a time
+class testSignal{
+public:
+	testSignal(int t, float f, float snr, uint32_t seed):type(t), frequency(f), noiseState(seed){ // Constructor
+		harmonics = (type == SIGNAL_TONE) ? 1 : 6;
+		voices = (type == SIGNAL_CHORD) ? 3 : 1;
+		float ratios[] = {1, powf(2, 4.0 / 12.0), powf(2, 7.0 / 12.0)};
+		for(int v = 0; v < voices; v++){
+			ratio[v] = ratios[v];
+			phase[v] = 0;
+		}
+		amplitude = 0.25 / voices;
+
+		// Uniform noise between -noiseAmplitude and noiseAmplitude has a power of noiseAmplitude^2 / 3
+		double power = 0;
+		for(int v = 0; v < voices; v++){
+			for(int h = 1; h <= harmonics; h++){
+				if(frequency * ratio[v] * h < 0.5 * kSampleRate){
+					power += 0.5 * (amplitude / h) * (amplitude / h);
+				}
+			}
+		}
+		noiseAmplitude = (snr > 200) ? 0 : sqrt(3 * power / pow(10, snr / 10));
+	}
+
+	// Fundamental frequency at sample n
+	float reference(double n){
+		if(type == SIGNAL_VIBRATO){
+			return frequency * pow(2, (20.0 / 1200.0) * sin(2 * M_PI * 5.5 * n / kSampleRate));
+		}
+		if(type == SIGNAL_GLIDE){
+			return frequency * pow(2, n / (2.0 * kSampleRate));
+		}
+		return frequency;
+	}
+
+	float next(){
+		float f = reference(n++);
+		float sample = 0;
+		for(int v = 0; v < voices; v++){
+			for(int h = 1; h <= harmonics; h++){
+				if(f * ratio[v] * h < 0.5 * kSampleRate){
+					sample += sin(h * phase[v]) / h;
+				}
+			}
+			phase[v] = fmod(phase[v] + 2 * M_PI * f * ratio[v] / kSampleRate, 2 * M_PI);
+		}
+		return amplitude * sample + noiseAmplitude * (2 * random() - 1);
+	}
+
+private:
+	// Reproducible uniform noise between 0 and 1
+	float random(){
+		noiseState = noiseState * 1664525 + 1013904223;
+		return (noiseState >> 8) / 16777216.0f;
+	}
+
+	const int type;
+	const float frequency;
+	int harmonics;
+	int voices;
+	float ratio[3];
+	double phase[3];
+	float amplitude;
+	float noiseAmplitude;
+	uint32_t noiseState;
+	int64_t n = 0;
+};
+
+// One pitch detector, analysing the latest window of the samples pushed into it
+class detectionPath{
+public:
+	detectionPath(int d, int wS, int lag, float threshold):detector(d), windowSize(wS){ // Constructor
+		input = new circularBuffer(BUFFER_SIZE);
+		decimate = nullptr;
+		fixedFFT = nullptr;
+		analysisSize = windowSize;
+		int analysisRate = kSampleRate;
+		if(detector == DETECTOR_DECIMATED){
+			decimate = new decimator(kDecimationFactor, BUFFER_SIZE / kDecimationFactor);
+			analysisSize = windowSize / kDecimationFactor;
+			analysisRate = kSampleRate / kDecimationFactor;
+		}
+		if(detector == DETECTOR_FIXED){
+			fixedFFT = new FFTContainerQ31(windowSize, kSampleRate);
+		}
+		fft = new FFTContainer(analysisSize, analysisRate);
+		hps = new HPS(analysisSize, analysisRate);
+		hps->setPeakDetection(lag, threshold);
+
+		window = fftPlanCache::acquireHanningWindow(analysisSize);
+		windowQ31 = (ne10_int32_t*)malloc(analysisSize * sizeof(ne10_int32_t));
+		for(int i = 0; i < analysisSize; i++){
+			windowQ31[i] = floatToQ31(window[i]);
+		}
+	}
+
+	~detectionPath(){ // Destructor
+		delete input;
+		if(decimate){
+			delete decimate;
+		}
+		if(fixedFFT){
+			delete fixedFFT;
+		}
+		delete fft;
+		delete hps;
+		fftPlanCache::release(window);
+		free(windowQ31);
+	}
+
+	// Filtering for the decimated path is part of its cost, so is done as samples arrive
+	inline void push(float sample){
+		if(decimate){
+			decimate->process(sample);
+		}
+		else{
+			input->insert(sample);
+		}
+	}
+
+	// Estimate the fundamental of the latest window, or 0 if there isn't one
+	float analyse(){
+		circularBuffer* source = decimate ? decimate->returnOutputBuffer() : input;
+		source->setReadPointer(source->returnWritePointer() - analysisSize);
+
+		if(detector == DETECTOR_FIXED){
+			for(int i = 0; i < analysisSize; i++){
+				fixedFFT->timeDomainIn[i].r = multiplyQ31(floatToQ31(source->returnNextElement()), windowQ31[i]);
+				fixedFFT->timeDomainIn[i].i = 0;
+			}
+			fixedFFT->forward();
+			hps->importFixedPointSpectrum(fixedFFT->frequencyDomain, fixedFFT->frequencyExponent);
+			hps->calculateFixedPoint();
+		}
+		else{
+			for(int i = 0; i < analysisSize; i++){
+				fft->timeDomainIn[i].r = (ne10_float32_t)source->returnNextElement() * window[i];
+				fft->timeDomainIn[i].i = 0;
+			}
+			ne10_fft_c2c_1d_float32_neon(fft->frequencyDomain, fft->timeDomainIn, fft->cfg, 0);
+			hps->importSpectrum(fft->frequencyDomain);
+			hps->calculate();
+		}
+		int peakBin = hps->returnPeakLocation();
+		return (peakBin == 0) ? 0 : hps->estimateFundamentalFrequency(peakBin);
+	}
+
+	// Frequency of the strongest partial of the latest window within range cents of expected, for the float detector
+	float strongestPartial(float expected, float range){
+		input->setReadPointer(input->returnWritePointer() - analysisSize);
+		for(int i = 0; i < analysisSize; i++){
+			fft->timeDomainIn[i].r = (ne10_float32_t)input->returnNextElement() * window[i];
+			fft->timeDomainIn[i].i = 0;
+		}
+		ne10_fft_c2c_1d_float32_neon(fft->frequencyDomain, fft->timeDomainIn, fft->cfg, 0);
+
+		float frequencyStep = (float)kSampleRate / analysisSize;
+		int first = floor(expected * pow(2, -range / 1200) / frequencyStep);
+		int last = ceil(expected * pow(2, range / 1200) / frequencyStep);
+		int peak = first;
+		float peakMagnitude = 0;
+		for(int k = first; k <= last; k++){
+			float magnitude = hypotf(fft->frequencyDomain[k].r, fft->frequencyDomain[k].i);
+			if(magnitude > peakMagnitude){
+				peak = k;
+				peakMagnitude = magnitude;
+			}
+		}
+
+		// Quadratic interpolation, as in HPS::estimateFundamentalFrequency()
+		float alpha = hypotf(fft->frequencyDomain[peak-1].r, fft->frequencyDomain[peak-1].i);
+		float gamma = hypotf(fft->frequencyDomain[peak+1].r, fft->frequencyDomain[peak+1].i);
+		float denominator = alpha - 2 * peakMagnitude + gamma;
+		float offset = (denominator != 0) ? 0.5 * (alpha - gamma) / denominator : 0;
+		return (peak + offset) * frequencyStep;
+	}
+
+private:
+	const int detector;
+	const int windowSize;
+	int analysisSize;
+	circularBuffer* input;
+	decimator* decimate;
+	FFTContainer* fft;
+	FFTContainerQ31* fixedFFT;
+	HPS* hps;
+	const float* window;
+	ne10_int32_t* windowQ31;
+};
+
+// Results for one row of the table
+struct benchmarkResult{
+	int hops = 0;
+	int grossErrors = 0;
+	double absoluteCents = 0; // Sum of absolute errors of the estimates that aren't gross errors
+	double latency = 0; // Sum of the latencies of the cases that locked, in samples
+	int locked = 0;
+	double seconds = 0; // Processing time
+	int processedHops = 0;
+
+	float grossPercent(){
+		return hops > 0 ? 100.0 * grossErrors / hops : 100;
+	}
+
+	float meanCents(){
+		int good = hops - grossErrors;
+		return good > 0 ? absoluteCents / good : 0;
+	}
+};
+
+float centsBetween(float estimate, float reference){
+	return (estimate > 0) ? 1200 * log2(estimate / reference) : 1e6;
+}
+
+void score(benchmarkResult& result, float estimate, float reference){
+	float cents = fabs(centsBetween(estimate, reference));
+	result.hops++;
+	if(cents > 50){
+		result.grossErrors++;
+	}
+	else{
+		result.absoluteCents += cents;
+	}
+}
+
+double timeSince(std::chrono::steady_clock::time_point start){
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void printResult(const char* stage, const char* engine, int windowSize, int hopSize, int lag, float threshold, const char* signal, benchmarkResult& result){
+	printf("%-7s %-9s %6d %5d %3d %9g %-10s %5d %9.2f %6.2f %10.1f %10.1f\n", stage, engine, windowSize, hopSize, lag, threshold, signal,
+		result.hops, result.grossPercent(), result.meanCents(),
+		result.locked > 0 ? 1000.0 * result.latency / result.locked / kSampleRate : -1.0,
+		result.processedHops > 0 ? 1e6 * result.seconds / result.processedHops : 0.0);
+}
+
+// Run one detector over every fundamental of one test signal
+void benchmarkDetection(detectionPath& path, int windowSize, int hopSize, const corpusEntry& entry, benchmarkResult& result){
+	int toneLength = kToneSeconds * kSampleRate;
+	for(float note : kNotes){
+		float frequency = note * pow(2, kDetune / 1200);
+		testSignal signal(entry.type, frequency, entry.snr, 1);
+
+		// A window of silence clears the last case from the buffers and filters
+		int silence = (windowSize / hopSize) * hopSize;
+		bool locked = false;
+		for(int end = hopSize - silence; end <= toneLength; end += hopSize){
+			auto start = std::chrono::steady_clock::now();
+			for(int i = 0; i < hopSize; i++){
+				path.push((end - hopSize + i < 0) ? 0 : signal.next());
+			}
+			float estimate = path.analyse();
+			result.seconds += timeSince(start);
+			result.processedHops++;
+			if(end <= 0){
+				continue;
+			}
+
+			// The reference is the fundamental at the centre of the window
+			float reference = signal.reference(fmax(end - windowSize / 2, 0));
+			if(!locked && fabs(centsBetween(estimate, reference)) <= 50){
+				locked = true;
+				result.latency += end;
+				result.locked++;
+			}
+			if(end >= windowSize){
+				score(result, estimate, reference);
+			}
+		}
+	}
+}
+
+// Run one correction engine over every fundamental of one test signal, measuring the output with reference
+void benchmarkCorrection(pitchCorrector& corrector, detectionPath& reference, int windowSize, int hopSize, const corpusEntry& entry, benchmarkResult& result){
+	int toneLength = kToneSeconds * kSampleRate;
+	int delay = corrector.returnLatency();
+	float* output = (float*)malloc(hopSize * sizeof(float));
+
+	for(float note : kNotes){
+		float frequency = note * pow(2, kDetune / 1200);
+		testSignal signal(entry.type, frequency, entry.snr, 1);
+		corrector.reset();
+		corrector.setScale(kScale);
+
+		// Flush the reference detector with silence
+		for(int i = 0; i < kReferenceWindowSize; i++){
+			reference.push(0);
+		}
+
+		bool locked = false;
+		int referenceCounter = 0;
+		for(int end = hopSize; end <= toneLength + delay; end += hopSize){
+			auto start = std::chrono::steady_clock::now();
+			for(int i = 0; i < hopSize; i++){
+				output[i] = corrector.process((end - hopSize + i < toneLength) ? signal.next() : 0);
+			}
+			result.seconds += timeSince(start);
+			result.processedHops++;
+
+			// The corrector has just processed the window ending at end
+			float centre = signal.reference(fmax(end - windowSize / 2, 0));
+			if(!locked && fabs(centsBetween(corrector.returnFundamentalFrequency(), centre)) <= 50){
+				locked = true;
+				result.latency += end + delay;
+				result.locked++;
+			}
+
+			// Output sample m came from input sample m - delay. Score the output once every hop that
+			// contributed to the reference window was analysing the tone alone
+			for(int i = 0; i < hopSize; i++){
+				reference.push(output[i]);
+				if(++referenceCounter < kReferenceHopSize){
+					continue;
+				}
+				referenceCounter = 0;
+				int inputEnd = end - hopSize + i + 1 - delay;
+				int inputStart = inputEnd - kReferenceWindowSize;
+				if(inputStart < windowSize || inputEnd > toneLength){
+					continue;
+				}
+				float target = compareNotes(kScale, signal.reference(inputEnd - kReferenceWindowSize / 2));
+				score(result, reference.strongestPartial(target, kReferenceRange), target);
+			}
+		}
+	}
+	free(output);
+}
+
+// Parse a comma separated list of numbers, returning how many were found
+int parseList(const char* text, float* values, int capacity){
+	int count = 0;
+	while(*text && count < capacity){
+		char* end;
+		float value = strtof(text, &end);
+		if(end == text){
+			break;
+		}
+		values[count++] = value;
+		text = (*end == ',') ? end + 1 : end;
+	}
+	return count;
+}
+
+// Whether a comma separated list contains name
+bool hasName(const char* list, const char* name){
+	int length = strlen(name);
+	while(*list){
+		const char* end = strchr(list, ',');
+		int itemLength = end ? end - list : strlen(list);
+		if(itemLength == length && strncmp(list, name, length) == 0){
+			return true;
+		}
+		if(!end){
+			break;
+		}
+		list = end + 1;
+	}
+	return false;
+}
+
+// A row that meets the accuracy bar on every signal, and its cost
+struct candidate{
+	const char* engine;
+	int windowSize;
+	int hopSize;
+	int lag;
+	float threshold;
+	double cost; // Processing time per second of audio
+};
+
+int main(int argc, char** argv){
+	float lags[16] = {5};
+	float thresholds[16] = {20};
+	int lagCount = 1;
+	int thresholdCount = 1;
+	float maxGross = 5;
+	float maxCents = 10;
+	for(int i = 1; i + 1 < argc; i += 2){
+		if(strcmp(argv[i], "-l") == 0){
+			lagCount = parseList(argv[i + 1], lags, 16);
+		}
+		else if(strcmp(argv[i], "-t") == 0){
+			thresholdCount = parseList(argv[i + 1], thresholds, 16);
+		}
+		else if(strcmp(argv[i], "-g") == 0){
+			maxGross = atof(argv[i + 1]);
+		}
+		else if(strcmp(argv[i], "-m") == 0){
+			maxCents = atof(argv[i + 1]);
+		}
+		else if(strcmp(argv[i], "-s") == 0){
+			for(int s = 0; s < kCorpusSize; s++){
+				kCorpus[s].inBar = hasName(argv[i + 1], kCorpus[s].name);
+			}
+		}
+	}
+
+	ne10_init();
+
+	printf("stage   engine    window   hop lag threshold signal      hops gross_pct  cents latency_ms us_per_hop\n");
+
+	candidate bestDetector = {nullptr, 0, 0, 0, 0, 1e9};
+	candidate bestCorrector = bestDetector;
+	detectionPath reference(DETECTOR_FLOAT, kReferenceWindowSize, 5, 20);
+	fprintf(stderr, "Accuracy bar: at most %.1f%% gross errors and %.1f cents on", maxGross, maxCents);
+	for(int s = 0; s < kCorpusSize; s++){
+		if(kCorpus[s].inBar){
+			fprintf(stderr, " %s", kCorpus[s].name);
+		}
+	}
+	fprintf(stderr, "\n");
+
+	for(auto& configuration : kConfigurations){
+		int windowSize = configuration[0];
+		int hopSize = configuration[1];
+		for(int l = 0; l < lagCount; l++){
+			for(int t = 0; t < thresholdCount; t++){
+				int lag = lags[l];
+				float threshold = thresholds[t];
+
+				for(int d = 0; d < DETECTORS; d++){
+					detectionPath path(d, windowSize, lag, threshold);
+					bool accurate = true;
+					double seconds = 0;
+					int processedHops = 0;
+					for(int s = 0; s < kCorpusSize; s++){
+						benchmarkResult result;
+						benchmarkDetection(path, windowSize, hopSize, kCorpus[s], result);
+						printResult("detect", kDetectorNames[d], windowSize, hopSize, lag, threshold, kCorpus[s].name, result);
+						if(kCorpus[s].inBar){
+							accurate = accurate && result.grossPercent() <= maxGross && result.meanCents() <= maxCents;
+						}
+						seconds += result.seconds;
+						processedHops += result.processedHops;
+					}
+					double cost = seconds / processedHops * kSampleRate / hopSize;
+					if(accurate && cost < bestDetector.cost){
+						bestDetector = {kDetectorNames[d], windowSize, hopSize, lag, threshold, cost};
+					}
+				}
+
+				for(int e = ENGINE_PHASE_VOCODER; e <= ENGINE_PSOLA; e++){
+					correctionConfig config;
+					config.windowSize = windowSize;
+					config.hopSize = hopSize;
+					config.sampleRate = kSampleRate;
+					config.engine = e;
+					pitchCorrector corrector(config);
+					corrector.setPeakDetection(lag, threshold);
+					bool accurate = true;
+					double seconds = 0;
+					int processedHops = 0;
+					for(int s = 0; s < kCorpusSize; s++){
+						if(!kCorpus[s].correctable){
+							continue;
+						}
+						benchmarkResult result;
+						benchmarkCorrection(corrector, reference, windowSize, hopSize, kCorpus[s], result);
+						printResult("correct", kEngineNames[e], windowSize, hopSize, lag, threshold, kCorpus[s].name, result);
+						if(kCorpus[s].inBar){
+							accurate = accurate && result.grossPercent() <= maxGross && result.meanCents() <= maxCents;
+						}
+						seconds += result.seconds;
+						processedHops += result.processedHops;
+					}
+					double cost = seconds / processedHops * kSampleRate / hopSize;
+					if(accurate && cost < bestCorrector.cost){
+						bestCorrector = {kEngineNames[e], windowSize, hopSize, lag, threshold, cost};
+					}
+				}
+				fflush(stdout);
+			}
+		}
+	}
+
+	// Glides and chords aren't corrected, so are left out of the bar for correction
+	candidate* best[] = {&bestDetector, &bestCorrector};
+	const char* stages[] = {"detector", "correction engine"};
+	for(int i = 0; i < 2; i++){
+		if(best[i]->engine){
+			fprintf(stderr, "Cheapest %s meeting the accuracy bar: %s, %d/%d, lag %d, threshold %g (%.1f ms per second of audio)\n",
+				stages[i], best[i]->engine, best[i]->windowSize, best[i]->hopSize, best[i]->lag, best[i]->threshold, 1000 * best[i]->cost);
+		}
+		else{
+			fprintf(stderr, "No %s meets the accuracy bar\n", stages[i]);
+		}
+	}
+
+	return 0;
+}
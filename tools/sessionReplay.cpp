@@ -0,0 +1,282 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+// Replays a session recorded with gSessionRecordPath through render.cpp on a workstation
+// render.cpp is set up with the configuration in the recording, and refuses to replay if it can't be reproduced
+// The input blocks, button states and control changes are fed back exactly as they were recorded, and each hop is
+// processed on its own at the same frame as it was live, so late hops are handled in the same way
+// Any hop whose lateness differs from the recording is counted and reported
+// With --ideal, every hop is processed as soon as it is scheduled instead
+// Reports how long the hops take to process here and a checksum of the output, which is the same on every run
+// The output can also be written to a file as raw interleaved float
+// Build with -DRT_SAFETY_AUDIT -ldl as well to audit the replayed session
+//
+// Build and run on a workstation from the project directory:
+//   g++ -O2 -std=c++11 -I tools/host -I . tools/sessionReplay.cpp -o sessionReplay -lpthread
+//   ./sessionReplay session.bin [output.raw] [--ideal]
+
+#include <stddef.h>
+#include <vector>
+
+#include "render.cpp"
+
+const uint64_t kNotRecorded = ~0ULL;
+
+// Set the controls render() publishes to those recorded
+void applySessionControls(const sessionControls& controls){
+	gScale = controls.scale;
+	gKey = controls.key;
+	gCorrectionStrength = controls.strength;
+	int engineCount = sizeof(gChannelEngines) / sizeof(gChannelEngines[0]);
+	for(int channel = 0; channel < engineCount && channel < CONTROL_MAX_CHANNELS; channel++){
+		gChannelEngines[channel] = controls.engines[channel];
+	}
+}
+
+// Print a setting that differs from the recording. Returns true if it matches
+bool checkSetting(const char* setting, int recorded, int replayed){
+	if(recorded != replayed){
+		printf("Recorded with %s %d, but replaying with %d\n", setting, recorded, replayed);
+		return false;
+	}
+	return true;
+}
+
+// Check that render.cpp was set up as the session was recorded
+bool matchesSession(const sessionHeader& header){
+	bool matches = checkSetting("channels", header.channels, gAudioChannels);
+	matches = checkSetting("window size", header.windowSize, gWindowSize) && matches;
+	matches = checkSetting("hop size", header.hopSize, gHopSize) && matches;
+	matches = checkSetting("detection window size", header.detectionWindowSize, gDetectionWindowSize) && matches;
+	matches = checkSetting("analysis interval", header.analysisInterval, gAnalysisInterval) && matches;
+	for(int channel = 0; channel < gAudioChannels && channel < CONTROL_MAX_CHANNELS; channel++){
+		matches = checkSetting("engine", header.controls.engines[channel], gChannels[channel]->returnEngine()) && matches;
+	}
+	return matches;
+}
+
+int main(int argc, char** argv){
+	const char* sessionPath = nullptr;
+	const char* outputPath = nullptr;
+	bool ideal = false;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "--ideal") == 0){
+			ideal = true;
+		}
+		else if(sessionPath == nullptr){
+			sessionPath = argv[i];
+		}
+		else{
+			outputPath = argv[i];
+		}
+	}
+	if(sessionPath == nullptr){
+		printf("Usage: sessionReplay session.bin [output.raw] [--ideal]\n");
+		return 1;
+	}
+
+	FILE* session = fopen(sessionPath, "rb");
+	if(session == nullptr){
+		printf("Couldn't open %s\n", sessionPath);
+		return 1;
+	}
+	// Only sessions recorded with this header layout hold the whole configuration
+	sessionHeader header;
+	if(fread(&header, offsetof(sessionHeader, headerSize), 1, session) != 1 || header.magic != SESSION_MAGIC){
+		printf("%s isn't a session recording\n", sessionPath);
+		return 1;
+	}
+	if(header.version != SESSION_VERSION){
+		printf("%s is a version %u session recording, which this replay can't reproduce. Record it again\n", sessionPath, header.version);
+		return 1;
+	}
+	if(fread(&header.headerSize, sizeof(header) - offsetof(sessionHeader, headerSize), 1, session) != 1 || header.headerSize != sizeof(header)){
+		printf("%s has a %u byte header, but this replay expects %u bytes\n", sessionPath, header.headerSize, (unsigned int)sizeof(header));
+		return 1;
+	}
+	int samplesPerBlock = header.blockSize * header.channels;
+
+	// Hop and control events can come after the blocks which follow them, so collect them first
+	std::vector<uint64_t> hopFrames;
+	std::vector<int> hopLateness;
+	std::vector<sessionControlsChange> controlChanges;
+	sessionEvent event;
+	while(fread(&event, sizeof(event), 1, session) == 1){
+		if(event.type == SESSION_BLOCK){
+			fseek(session, samplesPerBlock * sizeof(float), SEEK_CUR);
+		}
+		else if(event.type == SESSION_CONTROLS){
+			sessionControlsChange change;
+			change.frame = event.frame;
+			if(fread(&change.controls, sizeof(change.controls), 1, session) != 1){
+				break;
+			}
+			controlChanges.push_back(change);
+		}
+		else if(event.type == SESSION_HOP){
+			if(event.sequence >= hopFrames.size()){
+				hopFrames.resize(event.sequence + 1, kNotRecorded);
+				hopLateness.resize(event.sequence + 1, 0);
+			}
+			hopFrames[event.sequence] = event.frame;
+			hopLateness[event.sequence] = event.lateFrames;
+		}
+	}
+	fseek(session, sizeof(header), SEEK_SET);
+
+	FILE* output = nullptr;
+	if(outputPath){
+		output = fopen(outputPath, "wb");
+		if(output == nullptr){
+			printf("Couldn't open %s\n", outputPath);
+			return 1;
+		}
+	}
+
+	// Use the settings the session was recorded with
+	gWindowSize = header.windowSize;
+	gHopSize = header.hopSize;
+	gDetectionWindowSize = header.detectionWindowSize;
+	gAnalysisInterval = header.analysisInterval;
+	gLowLatency = false; // Already applied to the sizes above
+	gLateHopPolicy = header.lateHopPolicy;
+	gVoices = header.voices;
+	gDecimatedAnalysis = header.decimatedAnalysis;
+	gDecimationFactor = header.decimationFactor;
+	gFixedPointProcessing = header.fixedPoint;
+	gFormantPreservation = header.formantPreservation;
+	applySessionControls(header.controls);
+	gTelemetrySummaryInterval = 0;
+
+	BelaContext context = {};
+	context.audioFrames = header.blockSize;
+	context.audioInChannels = header.channels;
+	context.audioOutChannels = header.channels;
+	context.audioSampleRate = header.sampleRate;
+	context.digitalFrames = header.blockSize;
+	context.digitalChannels = 16;
+	context.audioIn = (float*)malloc(samplesPerBlock * sizeof(float));
+	context.audioOut = (float*)malloc(samplesPerBlock * sizeof(float));
+	context.digital = (uint32_t*)malloc(header.blockSize * sizeof(uint32_t));
+	for(unsigned int n = 0; n < header.blockSize; n++){
+		context.digital[n] = 0xffff0000; // Buttons released until the first block says otherwise
+	}
+
+	if(!setup(&context, nullptr)){
+		return 1;
+	}
+	if(!matchesSession(header)){
+		printf("%s can't be replayed with this configuration\n", sessionPath);
+		cleanup(&context, nullptr);
+		return 1;
+	}
+
+	int blocks = 0;
+	int gaps = 0;
+	int hopsProcessed = 0;
+	int mismatches = 0; // Hops processed at a different lateness to the recording
+	size_t nextControls = 0;
+	uint64_t expectedFrame = kNotRecorded;
+	uint64_t processingTime = 0;
+	uint64_t worstProcessingTime = 0;
+	uint32_t checksum = 2166136261u; // FNV-1a over the output
+	uint64_t replayStart = telemetry::now();
+
+	while(fread(&event, sizeof(event), 1, session) == 1){
+		if(event.type == SESSION_CONTROLS){
+			fseek(session, sizeof(sessionControls), SEEK_CUR);
+		}
+		if(event.type != SESSION_BLOCK){
+			continue;
+		}
+		if(fread(context.audioIn, sizeof(float), samplesPerBlock, session) != (size_t)samplesPerBlock){
+			break;
+		}
+		if(expectedFrame != kNotRecorded && event.frame != expectedFrame){
+			gaps++;
+		}
+		expectedFrame = event.frame + header.blockSize;
+
+		context.audioFramesElapsed = event.frame;
+		for(unsigned int n = 0; n < header.blockSize; n++){
+			context.digital[n] = event.digital << 16;
+		}
+
+		// Controls changed from outside render() took effect from the start of the block they were recorded with
+		while(nextControls < controlChanges.size() && controlChanges[nextControls].frame <= event.frame){
+			applySessionControls(controlChanges[nextControls].controls);
+			nextControls++;
+		}
+
+		render(&context, nullptr);
+		blocks++;
+
+		// Process each waiting hop once render() reaches the frame it was processed at live
+		// Live, render() could move on while hops were being processed, so each is checked against its own frame
+		hopRequest hop;
+		while(gHopScheduler->peek(hop)){
+			// Hops after the last recorded one hadn't been processed when the recording stopped
+			if(!ideal && hop.sequence >= hopFrames.size()){
+				break;
+			}
+			bool recorded = hop.sequence < hopFrames.size() && hopFrames[hop.sequence] != kNotRecorded;
+			if(!ideal && recorded && hopFrames[hop.sequence] > event.frame){
+				break;
+			}
+			gHopScheduler->next(hop);
+			if(!ideal && recorded && gHopScheduler->lateness(hop) != hopLateness[hop.sequence]){
+				mismatches++;
+			}
+			uint64_t start = telemetry::now();
+			processScheduledHop(hop);
+			uint64_t elapsed = telemetry::now() - start;
+			hopsProcessed++;
+			processingTime += elapsed;
+			if(elapsed > worstProcessingTime){
+				worstProcessingTime = elapsed;
+			}
+		}
+
+		for(int i = 0; i < samplesPerBlock; i++){
+			uint32_t bits;
+			memcpy(&bits, &context.audioOut[i], sizeof(bits));
+			for(int byte = 0; byte < 4; byte++){
+				checksum = (checksum ^ ((bits >> (8 * byte)) & 0xff)) * 16777619u;
+			}
+		}
+		if(output){
+			fwrite(context.audioOut, sizeof(float), samplesPerBlock, output);
+		}
+	}
+
+	double replayTime = (telemetry::now() - replayStart) * 1e-9;
+	double sessionTime = (double)blocks * header.blockSize / header.sampleRate;
+	printf("Replayed %d blocks (%.1fs of audio) in %.2fs, %d hops\n", blocks, sessionTime, replayTime, hopsProcessed);
+	if(hopsProcessed > 0){
+		printf("Hop processing: mean %.1fus, worst %.1fus, budget %.1fus\n", processingTime * 1e-3 / hopsProcessed,
+			worstProcessingTime * 1e-3, 1e6 * header.hopSize / header.sampleRate);
+	}
+	if(gaps > 0){
+		printf("%d gaps in the recording. Blocks were dropped while recording, so the replay isn't exact\n", gaps);
+	}
+	if(mismatches > 0){
+		printf("%d hops processed at a different lateness to the recording, so the replay isn't exact\n", mismatches);
+	}
+	printf("Output checksum %08x\n", checksum);
+
+	cleanup(&context, nullptr);
+
+	fclose(session);
+	if(output){
+		fclose(output);
+	}
+	free(context.audioIn);
+	free(context.audioOut);
+	free(context.digital);
+
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+// Pitch correction of raw interleaved PCM from stdin to stdout, for use in a Unix pipeline
+// Uses pitchCorrector.h, which runs the same correctionChannel as render.cpp
+// Input is read in large blocks to keep system calls down, but whatever whole frames a read returns are
+// processed and written straight away, so the only latency added is a window and a hop (5120 frames)
+// With -l, correction runs on a 512 frame window and 128 frame hop while pitch is still detected on 4096 frames
+// every 4 hops, for around 15ms of latency at 44.1kHz. The phase vocoder only corrects fundamentals above about
+// 300Hz on the short window; a single voice below that is corrected by PSOLA, a little later the lower it is
+// By default the output is realigned with the input: the first window and hop of output are dropped and the end is
+// flushed, so the output has exactly as many frames as the input. -d keeps the delay instead, for live streams
+// Statistics go to stderr
+// If the reader of the output goes away (for example `| head -c`), the stream stops there, the statistics are still
+// printed and the exit status is 0, rather than the process being killed by SIGPIPE
+//
+// Build and run on a workstation from the project directory:
+//   g++ -O2 -std=c++11 -I tools/host -I . tools/streamCorrect.cpp -o streamCorrect
+//   ffmpeg -i in.flac -f f32le -ac 1 -ar 44100 - | ./streamCorrect -t f32 -c 1 | ffmpeg -f f32le -ac 1 -ar 44100 -i - out.flac
+//
+// Options:
+//   -r rate      sample rate (44100)
+//   -c channels  interleaved channels (1)
+//   -t s16|f32   sample format of both input and output (s16)
+//   -s scale     PENTATONIC, C_MAJOR or C_MINOR (PENTATONIC)
+//   -k key       semitones above C (0)
+//   -e engine    vocoder or psola (vocoder)
+//   -v voices    voices corrected separately by the vocoder, for polyphonic sources (1)
+//   -b frames    largest block read at once (8192)
+//   -d           don't realign the output with the input
+//   -l           low-latency mode
+//   -p           preserve formants (vocoder only)
+
+#include <Bela.h>
+#include <libraries/ne10/NE10.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pitchCorrector.h"
+#include "telemetry.h"
+
+const int kWindowSize = 4096;
+const int kHopSize = kWindowSize / 4;
+const int kLowLatencyWindowSize = 512; // Correction window for -l. Pitch detection keeps kWindowSize
+const int kLowLatencyHopSize = 128;
+const int kLowLatencyAnalysisInterval = 4; // Hops between pitch detections for -l, as in render.cpp
+
+const char* kScaleNames[] = {"PENTATONIC", "C_MAJOR", "C_MINOR"};
+
+// Write all of a buffer, carrying on after partial writes and interruptions. Returns false if the output has failed,
+// with errno set (EPIPE if the pipe was closed)
+bool writeAll(const uint8_t* data, size_t bytes){
+	while(bytes > 0){
+		ssize_t result = write(STDOUT_FILENO, data, bytes);
+		if(result < 0 && errno == EINTR){
+			continue;
+		}
+		if(result <= 0){
+			return false;
+		}
+		data += result;
+		bytes -= result;
+	}
+	return true;
+}
+
+int main(int argc, char** argv){
+	// Report a closed output as EPIPE from write() instead of being killed
+	signal(SIGPIPE, SIG_IGN);
+
+	int sampleRate = 44100;
+	int channels = 1;
+	bool floatSamples = false;
+	int scale = 0;
+	int key = 0;
+	int engine = ENGINE_PHASE_VOCODER;
+	int voices = 1;
+	int blockFrames = 8192;
+	bool realign = true;
+	bool lowLatency = false;
+	bool preserveFormants = false;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "-d") == 0){
+			realign = false;
+		}
+		else if(strcmp(argv[i], "-l") == 0){
+			lowLatency = true;
+		}
+		else if(strcmp(argv[i], "-p") == 0){
+			preserveFormants = true;
+		}
+		else if(i + 1 < argc){
+			const char* value = argv[++i];
+			if(strcmp(argv[i - 1], "-r") == 0){
+				sampleRate = atoi(value);
+			}
+			else if(strcmp(argv[i - 1], "-c") == 0){
+				channels = atoi(value);
+			}
+			else if(strcmp(argv[i - 1], "-t") == 0){
+				floatSamples = (strcmp(value, "f32") == 0);
+			}
+			else if(strcmp(argv[i - 1], "-s") == 0){
+				for(int s = 0; s < 3; s++){
+					if(strcmp(value, kScaleNames[s]) == 0){
+						scale = s;
+					}
+				}
+			}
+			else if(strcmp(argv[i - 1], "-k") == 0){
+				key = atoi(value) % 12;
+			}
+			else if(strcmp(argv[i - 1], "-e") == 0){
+				engine = (strcmp(value, "psola") == 0) ? ENGINE_PSOLA : ENGINE_PHASE_VOCODER;
+			}
+			else if(strcmp(argv[i - 1], "-v") == 0){
+				voices = atoi(value);
+			}
+			else if(strcmp(argv[i - 1], "-b") == 0){
+				blockFrames = atoi(value);
+			}
+		}
+	}
+	if(channels < 1 || blockFrames < 1 || sampleRate < 1){
+		fprintf(stderr, "Invalid options\n");
+		return 1;
+	}
+
+	ne10_init();
+
+	correctionConfig config;
+	config.windowSize = lowLatency ? kLowLatencyWindowSize : kWindowSize;
+	config.hopSize = lowLatency ? kLowLatencyHopSize : kHopSize;
+	config.detectionWindowSize = kWindowSize;
+	config.sampleRate = sampleRate;
+	config.engine = engine;
+	config.voices = voices;
+	config.formantPreservation = preserveFormants;
+
+	pitchCorrector** correctors = (pitchCorrector**)malloc(channels * sizeof(pitchCorrector*));
+	for(int channel = 0; channel < channels; channel++){
+		correctors[channel] = new pitchCorrector(config);
+		correctors[channel]->setScale(scale);
+		correctors[channel]->setKey(key);
+		if(lowLatency){
+			correctors[channel]->setAnalysisInterval(kLowLatencyAnalysisInterval);
+		}
+	}
+
+	int bytesPerSample = floatSamples ? 4 : 2;
+	int frameBytes = channels * bytesPerSample;
+	size_t blockBytes = (size_t)blockFrames * frameBytes;
+	uint8_t* input = (uint8_t*)malloc(blockBytes);
+	uint8_t* output = (uint8_t*)malloc(blockBytes);
+
+	fprintf(stderr, "Latency %d frames (%.1fms), correcting fundamentals above %.0fHz\n", correctors[0]->returnLatency(),
+		1000.0 * correctors[0]->returnLatency() / sampleRate, correctors[0]->returnMinimumFrequency());
+
+	// Output frames still to be dropped to realign with the input
+	int64_t skip = realign ? correctors[0]->returnLatency() : 0;
+	int64_t framesIn = 0;
+	int64_t framesOut = 0;
+	int64_t reads = 0;
+	size_t pending = 0; // Bytes of a partial frame carried over from the last read
+	bool flushing = false;
+	int outputError = 0; // errno of a failed write, which ends the stream
+	int64_t flushFrames = realign ? correctors[0]->returnLatency() : 0;
+	uint64_t start = telemetry::now();
+
+	while(true){
+		int frames;
+		if(!flushing){
+			ssize_t result = read(STDIN_FILENO, input + pending, blockBytes - pending);
+			if(result < 0 && errno == EINTR){
+				continue;
+			}
+			if(result <= 0){
+				// End of the input. Push the last window through with silence
+				flushing = true;
+				continue;
+			}
+			reads++;
+			pending += result;
+			frames = pending / frameBytes;
+		}
+		else{
+			if(flushFrames <= 0){
+				break;
+			}
+			frames = (flushFrames < blockFrames) ? flushFrames : blockFrames;
+			memset(input, 0, frames * frameBytes);
+			flushFrames -= frames;
+		}
+
+		// Correct each whole frame, converting to and from float
+		int written = 0;
+		for(int n = 0; n < frames; n++){
+			bool keep = (skip == 0);
+			if(!keep){
+				skip--;
+			}
+			for(int channel = 0; channel < channels; channel++){
+				uint8_t* sample = input + (n * channels + channel) * bytesPerSample;
+				float in;
+				if(floatSamples){
+					memcpy(&in, sample, sizeof(float));
+				}
+				else{
+					int16_t value;
+					memcpy(&value, sample, sizeof(value));
+					in = value / 32768.0f;
+				}
+
+				float out = correctors[channel]->process(in);
+
+				if(keep){
+					uint8_t* destination = output + (written * channels + channel) * bytesPerSample;
+					if(floatSamples){
+						memcpy(destination, &out, sizeof(float));
+					}
+					else{
+						int16_t value = lrintf(fmin(fmax(out * 32768.0f, -32768.0f), 32767.0f));
+						memcpy(destination, &value, sizeof(value));
+					}
+				}
+			}
+			if(keep){
+				written++;
+			}
+		}
+
+		if(!flushing){
+			framesIn += frames;
+			// Keep any partial frame for the next read
+			size_t used = (size_t)frames * frameBytes;
+			memmove(input, input + used, pending - used);
+			pending -= used;
+		}
+		if(!writeAll(output, (size_t)written * frameBytes)){
+			outputError = errno;
+			break;
+		}
+		framesOut += written;
+	}
+
+	double seconds = (telemetry::now() - start) * 1e-9;
+	double audio = (double)framesIn / sampleRate;
+	fprintf(stderr, "%lld frames in, %lld out, %.1fs of audio in %.2fs (%.1fx real time), %.0f frames per read\n",
+		(long long)framesIn, (long long)framesOut, audio, seconds, audio / seconds, reads > 0 ? (double)framesIn / reads : 0.0);
+
+	if(outputError == EPIPE){
+		fprintf(stderr, "Output closed by the reader, stopped after %lld frames\n", (long long)framesOut);
+	}
+	else if(outputError != 0){
+		fprintf(stderr, "Couldn't write the output: %s\n", strerror(outputError));
+	}
+
+	for(int channel = 0; channel < channels; channel++){
+		if(correctors[channel]->returnHopsBelowRange() > 0){
+			fprintf(stderr, "Channel %d: %d hops below %.0fHz passed through unshifted\n", channel,
+				correctors[channel]->returnHopsBelowRange(), correctors[channel]->returnMinimumFrequency());
+		}
+		delete correctors[channel];
+	}
+	free(correctors);
+	free(input);
+	free(output);
+
+	// A closed pipe is the reader's choice, so only other write failures are errors
+	return (outputError == 0 || outputError == EPIPE) ? 0 : 1;
+}
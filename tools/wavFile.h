@@ -0,0 +1,236 @@
+/*
+ * Written for ECS7012U Music and
+ * Audio Programming, for the Bela platform.
+ *
+ * Alex Richardson 2020
+ */
+
+#ifndef WAVFILE_H
+#define WAVFILE_H
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Minimal WAV file access for the offline tools
+// Reads 16, 24 and 32-bit PCM and 32-bit float, and writes 16-bit PCM or 32-bit float
+// Frames are read and written at any position with pread/pwrite, so several threads can share one file
+// Samples are converted to and from interleaved float
+
+enum{ // Sample formats
+	WAV_PCM_16 = 0,
+	WAV_PCM_24,
+	WAV_PCM_32,
+	WAV_FLOAT_32
+};
+
+class wavReader{
+public:
+	~wavReader(){ // Destructor
+		close();
+	}
+
+	// Open a file and read its format. Returns false if it can't be read
+	bool open(const char* path){
+		descriptor = ::open(path, O_RDONLY);
+		if(descriptor < 0){
+			return false;
+		}
+
+		uint8_t riff[12];
+		if(pread(descriptor, riff, 12, 0) != 12 || memcmp(riff, "RIFF", 4) != 0 || memcmp(riff + 8, "WAVE", 4) != 0){
+			close();
+			return false;
+		}
+
+		// Walk the chunks for the format and the data
+		bool foundFormat = false;
+		off_t position = 12;
+		uint8_t chunk[8];
+		while(pread(descriptor, chunk, 8, position) == 8){
+			uint32_t chunkSize = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | ((uint32_t)chunk[7] << 24);
+			if(memcmp(chunk, "fmt ", 4) == 0){
+				uint8_t format[40] = {0};
+				pread(descriptor, format, chunkSize < 40 ? chunkSize : 40, position + 8);
+				int tag = format[0] | (format[1] << 8);
+				if(tag == 0xfffe){ // WAVE_FORMAT_EXTENSIBLE. The real tag starts the sub-format
+					tag = format[24] | (format[25] << 8);
+				}
+				channels = format[2] | (format[3] << 8);
+				sampleRate = format[4] | (format[5] << 8) | (format[6] << 16) | (format[7] << 24);
+				int bits = format[14] | (format[15] << 8);
+				if(tag == 3 && bits == 32){
+					sampleFormat = WAV_FLOAT_32;
+				}
+				else if(tag == 1 && bits == 16){
+					sampleFormat = WAV_PCM_16;
+				}
+				else if(tag == 1 && bits == 24){
+					sampleFormat = WAV_PCM_24;
+				}
+				else if(tag == 1 && bits == 32){
+					sampleFormat = WAV_PCM_32;
+				}
+				else{
+					break;
+				}
+				bytesPerSample = bits / 8;
+				foundFormat = true;
+			}
+			else if(memcmp(chunk, "data", 4) == 0 && foundFormat){
+				dataOffset = position + 8;
+				frames = chunkSize / (bytesPerSample * channels);
+				return true;
+			}
+			position += 8 + chunkSize + (chunkSize & 1);
+		}
+
+		close();
+		return false;
+	}
+
+	void close(){
+		if(descriptor >= 0){
+			::close(descriptor);
+			descriptor = -1;
+		}
+	}
+
+	// Read count frames starting at frame start into interleaved floats
+	// Frames before the start or after the end of the file are read as silence. raw must hold count frames in the file's format
+	void readFrames(int64_t start, int count, float* destination, uint8_t* raw){
+		memset(destination, 0, (size_t)count * channels * sizeof(float));
+		int64_t first = start < 0 ? 0 : start;
+		int64_t last = (start + count < frames) ? start + count : frames;
+		if(last <= first){
+			return;
+		}
+		size_t bytes = (last - first) * channels * bytesPerSample;
+		size_t done = 0;
+		while(done < bytes){
+			ssize_t result = pread(descriptor, raw + done, bytes - done, dataOffset + first * channels * bytesPerSample + done);
+			if(result <= 0){
+				break;
+			}
+			done += result;
+		}
+
+		float* output = destination + (first - start) * channels;
+		int samples = (last - first) * channels;
+		for(int i = 0; i < samples; i++){
+			uint8_t* sample = raw + i * bytesPerSample;
+			if(sampleFormat == WAV_PCM_16){
+				output[i] = (int16_t)(sample[0] | (sample[1] << 8)) / 32768.0f;
+			}
+			else if(sampleFormat == WAV_PCM_24){
+				output[i] = (int32_t)((sample[0] << 8) | (sample[1] << 16) | ((uint32_t)sample[2] << 24)) / 2147483648.0f;
+			}
+			else if(sampleFormat == WAV_PCM_32){
+				output[i] = (int32_t)(sample[0] | (sample[1] << 8) | (sample[2] << 16) | ((uint32_t)sample[3] << 24)) / 2147483648.0f;
+			}
+			else{
+				memcpy(&output[i], sample, sizeof(float));
+			}
+		}
+	}
+
+	int channels = 0;
+	int sampleRate = 0;
+	int sampleFormat = WAV_PCM_16;
+	int bytesPerSample = 2;
+	int64_t frames = 0;
+
+private:
+	int descriptor = -1;
+	off_t dataOffset = 0;
+};
+
+class wavWriter{
+public:
+	~wavWriter(){ // Destructor
+		close();
+	}
+
+	// Create a file for the given number of frames. Returns false if it can't be created
+	bool open(const char* path, int numChannels, int rate, int64_t numFrames, int format = WAV_PCM_16){
+		channels = numChannels;
+		frames = numFrames;
+		sampleFormat = (format == WAV_FLOAT_32) ? WAV_FLOAT_32 : WAV_PCM_16;
+		bytesPerSample = (sampleFormat == WAV_FLOAT_32) ? 4 : 2;
+		descriptor = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(descriptor < 0){
+			return false;
+		}
+
+		uint32_t dataSize = frames * channels * bytesPerSample;
+		uint8_t header[44];
+		memcpy(header, "RIFF", 4);
+		putWord(header + 4, 36 + dataSize, 4);
+		memcpy(header + 8, "WAVEfmt ", 8);
+		putWord(header + 16, 16, 4);
+		putWord(header + 20, (sampleFormat == WAV_FLOAT_32) ? 3 : 1, 2);
+		putWord(header + 22, channels, 2);
+		putWord(header + 24, rate, 4);
+		putWord(header + 28, rate * channels * bytesPerSample, 4);
+		putWord(header + 32, channels * bytesPerSample, 2);
+		putWord(header + 34, bytesPerSample * 8, 2);
+		memcpy(header + 36, "data", 4);
+		putWord(header + 40, dataSize, 4);
+		pwrite(descriptor, header, 44, 0);
+
+		// Size the file up front so that frames can be written in any order
+		if(ftruncate(descriptor, 44 + (off_t)dataSize) != 0){
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close(){
+		if(descriptor >= 0){
+			::close(descriptor);
+			descriptor = -1;
+		}
+	}
+
+	// Write count interleaved frames starting at frame start. raw must hold count frames in the file's format
+	void writeFrames(int64_t start, int count, const float* source, uint8_t* raw){
+		int samples = count * channels;
+		for(int i = 0; i < samples; i++){
+			if(sampleFormat == WAV_FLOAT_32){
+				memcpy(raw + i * 4, &source[i], sizeof(float));
+			}
+			else{
+				float sample = source[i] * 32768.0f;
+				sample = fmin(fmax(sample, -32768.0f), 32767.0f);
+				putWord(raw + i * 2, (uint16_t)(int16_t)lrintf(sample), 2);
+			}
+		}
+		size_t bytes = (size_t)samples * bytesPerSample;
+		size_t done = 0;
+		while(done < bytes){
+			ssize_t result = pwrite(descriptor, raw + done, bytes - done, 44 + start * channels * bytesPerSample + done);
+			if(result <= 0){
+				break;
+			}
+			done += result;
+		}
+	}
+
+	int channels = 0;
+	int sampleFormat = WAV_PCM_16;
+	int bytesPerSample = 2;
+	int64_t frames = 0;
+
+private:
+	// Little-endian integer of the given number of bytes
+	static void putWord(uint8_t* destination, uint32_t value, int bytes){
+		for(int i = 0; i < bytes; i++){
+			destination[i] = (value >> (8 * i)) & 0xff;
+		}
+	}
+
+	int descriptor = -1;
+};
+
+#endif //WAVFILE_H